@@ -13,7 +13,7 @@
 
 #define true 1
 #define false 0
-#define CALL_STRING_BUFFER 25
+#define CALL_STRING_BUFFER 100
 
 
 // Global variables for command line arguments (compiler directives)
@@ -22,6 +22,18 @@
 int directivePrintLexemes;
 int directivePrintAssembly;
 int directivePrintVMTrace;
+int directiveSetInlineBudget;
+int directiveInlineBudget;
+int directiveSetEvaluationBudget;
+int directiveEvaluationBudget;
+int directiveSetUnrollFactor;
+int directiveUnrollFactor;
+int directiveSetWorkerCount;
+int directiveWorkerCount;
+int directiveWriteProfile;
+int directiveUseProfile;
+int directiveSourceProfile;
+int directiveMemoize;
 
 
 // Functions
@@ -29,16 +41,15 @@ void checkDirectives(int argc, const char* argv[]);
 void printLexemeList();
 void printAssemblyCode();
 void printVMExecutionTrace();
+void printSourceProfile();
 
 
 int main(int argc, const char * argv[]) {
     
     
-    char callScanner[CALL_STRING_BUFFER];
     char callParser[CALL_STRING_BUFFER];
     char callPMachine[CALL_STRING_BUFFER];
     
-    strcpy(callScanner, "./Scanner");
     strcpy(callParser, "./Parser");
     strcpy(callPMachine, "./PMachine");
     
@@ -51,15 +62,44 @@ int main(int argc, const char * argv[]) {
         strcat(callParser, " -a");
     }
     
+    if (directiveSetInlineBudget) {
+        sprintf(callParser + strlen(callParser), " -i %d", directiveInlineBudget);
+    }
     
-    // Use to call each section and check for success, determine whether or not to continue
-    int returnValue = system(callScanner);
+    if (directiveSetEvaluationBudget) {
+        sprintf(callParser + strlen(callParser), " -e %d", directiveEvaluationBudget);
+    }
     
-    if (returnValue < 0 || WEXITSTATUS(returnValue) != EXIT_SUCCESS) {
-        exit(EXIT_FAILURE);
+    if (directiveSetUnrollFactor) {
+        sprintf(callParser + strlen(callParser), " -u %d", directiveUnrollFactor);
+    }
+    
+    if (directiveSetWorkerCount) {
+        sprintf(callParser + strlen(callParser), " -j %d", directiveWorkerCount);
+    }
+    
+    // The profile is read before the layout of the new code replaces the one it was taken from
+    if (directiveUseProfile) {
+        strcat(callParser, " -f");
+    }
+    
+    if (directiveWriteProfile) {
+        strcat(callParser, " -p");
+        strcat(callPMachine, " -p");
+    }
+    
+    if (directiveSourceProfile) {
+        strcat(callPMachine, " -s");
     }
     
-    returnValue = system(callParser);
+    if (directiveMemoize) {
+        strcat(callParser, " -m");
+    }
+    
+    
+    // Use to call each section and check for success, determine whether or not to continue
+    // The Parser runs the Scanner itself, pulling tokens from it as it parses
+    int returnValue = system(callParser);
     
     if (returnValue < 0 || WEXITSTATUS(returnValue) != EXIT_SUCCESS) {
         exit(EXIT_FAILURE);
@@ -85,6 +125,10 @@ int main(int argc, const char * argv[]) {
         printVMExecutionTrace();
     }
     
+    if (directiveSourceProfile) {
+        printSourceProfile();
+    }
+    
     
     
     
@@ -109,6 +153,46 @@ void checkDirectives(int argc, const char* argv[]) {
             directivePrintVMTrace = true;
         }
         
+        // Followed by the largest procedure, in instructions, to inline
+        else if ( (strcmp(argv[i], "-i")) == 0 && i + 1 < argc) {
+            directiveSetInlineBudget = true;
+            directiveInlineBudget = atoi(argv[++i]);
+        }
+        
+        // Followed by the most instructions to run at compile time
+        else if ( (strcmp(argv[i], "-e")) == 0 && i + 1 < argc) {
+            directiveSetEvaluationBudget = true;
+            directiveEvaluationBudget = atoi(argv[++i]);
+        }
+        
+        // Followed by how many copies of a loop body to run per iteration
+        else if ( (strcmp(argv[i], "-u")) == 0 && i + 1 < argc) {
+            directiveSetUnrollFactor = true;
+            directiveUnrollFactor = atoi(argv[++i]);
+        }
+        
+        // Followed by how many threads the Parser optimizes on
+        else if ( (strcmp(argv[i], "-j")) == 0 && i + 1 < argc) {
+            directiveSetWorkerCount = true;
+            directiveWorkerCount = atoi(argv[++i]);
+        }
+        
+        else if ( (strcmp(argv[i], "-p")) == 0) {
+            directiveWriteProfile = true;
+        }
+        
+        else if ( (strcmp(argv[i], "-f")) == 0) {
+            directiveUseProfile = true;
+        }
+        
+        else if ( (strcmp(argv[i], "-s")) == 0) {
+            directiveSourceProfile = true;
+        }
+        
+        else if ( (strcmp(argv[i], "-m")) == 0) {
+            directiveMemoize = true;
+        }
+        
         else printf("Unrecognized directive: %s", argv[i]);
         
     }
@@ -204,4 +288,28 @@ void printVMExecutionTrace() {
     
     
     fclose(VMPointer);
-}
\ No newline at end of file
+}
+
+
+void printSourceProfile() {
+    
+    // Open source profile file
+    FILE* profilePointer = fopen("sourceprofile.txt", "r");
+    
+    printf("\n\nPrinting out the source profile:\n\n");
+    
+    if ( ! profilePointer) {
+        printf("\nError finding source profile\n");
+        exit(1);
+    }
+    
+    int currentChar;
+    
+    while ( (currentChar = fgetc(profilePointer)) != EOF) {
+        printf("%c", currentChar);
+    }
+    
+    printf("\n\n");
+    
+    fclose(profilePointer);
+}
@@ -12,16 +12,27 @@
 //  NOTES:
 //  - Input file name is hardcoded, must be named "mcode.txt" and be in the same directory
 //  - Output is printed to a file named "stacktrace.txt" and is created in the working directory
+//  - With -p, how often each line ran and how often each conditional jump was taken is written to "profile.txt"
+//  - With -s, the instructions run and the time spent on each line of "input.txt" and in each procedure are
+//    written to "sourceprofile.txt", found through the line table the Parser leaves in "lines.txt"
+//  - The code starts with a header bounding the registers, stack and activation records, which are sized to fit
+//  - The bulk opcodes FIL, CPY, VAD and SUM work through arrays LANES words at a time with GCC vector extensions
+//  - JAL and JRT call and return from procedures whose frame the Parser fixed in the main block's, past its own words
+//  - MCL calls a procedure through a cache of MEMO_ENTRIES earlier calls, keyed on the slots listed after the code
 
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
 
 #define MAX_STACK_HEIGHT 2000
 #define MAX_CODE_LENGTH 500
 #define MAX_LEXI_LEVELS 3
+#define LANES 4
+#define MEMO_KEY 8
+#define MEMO_ENTRIES 64
 
 
 typedef struct {
@@ -31,26 +42,51 @@ typedef struct {
     int m;  // M
 } instruction;
 
+// Calls to one memoized procedure, by what its slots held going in and what it left in them
+// Each slot is so many static links up from the callee, and only those it may write are redone on a hit
+typedef struct {
+    int count;
+    int depth[MEMO_KEY];
+    int addr[MEMO_KEY];
+    int written[MEMO_KEY];
+    int* rows;              // MEMO_ENTRIES of a used flag, count values going in and count coming out
+} memoCache;
+
+// A memoized call still running, its cache entry is filled when the frame returns
+typedef struct {
+    int frame;
+    int cache;
+    int row;
+    int address[MEMO_KEY];
+    int key[MEMO_KEY];
+} pendingCall;
+
+// Words the bulk opcodes work on at a time, unsigned so sums wrap around the way register arithmetic does
+typedef unsigned int lanes __attribute__ ((vector_size (LANES * sizeof(int))));
+
 
 // Functions
 void outputCodeToFile(FILE *ofp, int code[][MAX_CODE_LENGTH], int codeLength);
 instruction fetch(int programCounter, int code[][MAX_CODE_LENGTH]);
 char* getOpCode(int opCode);
 int base(int l, int base, int* stack);
+int isConditionalJump(int op);
+void outputProfileToFile(long* executed, long* taken, int codeLength);
+void outputSourceProfile(long* executed, long long* spent, int codeLength);
+long long elapsed(struct timespec* from);
+void fillWords(int* to, int value, int count);
+void addWords(int* to, int* from, int count);
+int sumWords(int* from, int count);
+int recallCall(memoCache* cache, int link, int* stack, pendingCall* call);
+void rememberCall(memoCache* cache, pendingCall* call, int* stack);
 
 
-int main() {
+int main(int argc, char* argv[]) {
     
     int buffer, counter = 0, codeLen = 0;;
     int i, j;
     int line = 0;
     
-    // Stack
-    int stack[MAX_STACK_HEIGHT];
-    for ( i = 0; i < MAX_STACK_HEIGHT; i++ ) {
-        stack[i] = 0;
-    }
-    
     // Program code array
     int code[4][MAX_CODE_LENGTH];
     
@@ -73,20 +109,48 @@ int main() {
     ir.l = 0;
     ir.m = 0;
     
-    int reg[16];
-    for (i = 0; i < 16; i++) {
-        reg[i] = 0;
-    }
-    
-    
-    int ActRecLen[20];
     int curActRec = 0;
     
+    // Where an LCL returns to, a leaf calls nothing so one of each is enough
+    int linkPC = 0;
+    int linkBase = 0;
+    
     
     // Set halt
     int halt = 0;
     
     
+    // Execution profile and source profile, kept only when asked for
+    int profile = 0;
+    int sourceProfile = 0;
+    long executed[MAX_CODE_LENGTH] = { 0 };
+    long taken[MAX_CODE_LENGTH] = { 0 };
+    long long spent[MAX_CODE_LENGTH] = { 0 };
+    struct timespec started;
+    
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0)
+            profile = 1;
+        else if (strcmp(argv[i], "-s") == 0)
+            sourceProfile = 1;
+    }
+    
+    // What reading the clock costs is taken off the time of every instruction
+    long long clockCost = 0;
+    
+    if (sourceProfile) {
+        
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        
+        for (i = 0; i < 1000; i++) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        }
+        
+        clockCost = elapsed(&started) / 1001;
+    }
+    
+    
     FILE *inputPointer = fopen("temp.txt", "rb");
     
     if ( ! inputPointer) {
@@ -94,8 +158,30 @@ int main() {
         exit(1);
     }
     
+    // Header: registers, stack words and activation records the program needs, and its length
+    // A stack of 0 is one the Parser could not bound, it gets the full height and is checked as it grows
+    int registerCount = 0, stackHeight = 0, recordCount = 0, headerLength = 0;
+    
+    if (fscanf(inputPointer, "%d %d %d %d", &registerCount, &stackHeight, &recordCount, &headerLength) != 4
+        || headerLength > MAX_CODE_LENGTH) {
+        printf("Code for PMachine is invalid\n");
+        exit(1);
+    }
+    
+    int bounded = stackHeight > 0;
+    
+    if ( ! bounded) {
+        stackHeight = MAX_STACK_HEIGHT;
+        recordCount = MAX_STACK_HEIGHT / 4 + 2;
+    }
+    
+    // Stack
+    int* stack = calloc(stackHeight, sizeof(int));
+    int* reg = calloc(registerCount + 1, sizeof(int));
+    int* ActRecLen = calloc(recordCount, sizeof(int));
+    
     // Read the file and put it into the code memory
-    while (fscanf(inputPointer, "%d", &buffer) != EOF)
+    while (counter < headerLength * 4 && fscanf(inputPointer, "%d", &buffer) == 1)
     {
         code[counter % 4][counter/4] = buffer;
         
@@ -105,6 +191,37 @@ int main() {
     
     codeLen = counter / 4;
     
+    // The caches MCL calls through follow, when there are any
+    int memoCount = 0;
+    memoCache* memo = NULL;
+    
+    if (fscanf(inputPointer, "%d", &memoCount) != 1)
+        memoCount = 0;
+    
+    memo = calloc(memoCount + 1, sizeof(memoCache));
+    
+    for (i = 0; i < memoCount; i++) {
+        
+        if (fscanf(inputPointer, "%d", &memo[i].count) != 1 || memo[i].count < 1 || memo[i].count > MEMO_KEY) {
+            printf("Code for PMachine is invalid\n");
+            exit(1);
+        }
+        
+        for (j = 0; j < memo[i].count; j++) {
+            if (fscanf(inputPointer, "%d %d %d", &memo[i].depth[j], &memo[i].addr[j], &memo[i].written[j]) != 3) {
+                printf("Code for PMachine is invalid\n");
+                exit(1);
+            }
+        }
+        
+        memo[i].rows = calloc(MEMO_ENTRIES * (1 + 2 * memo[i].count), sizeof(int));
+    }
+    
+    // A memoized call runs in an activation record of its own, so there are never more pending than records
+    pendingCall* pending = calloc(recordCount, sizeof(pendingCall));
+    pendingCall call;
+    int pendingCount = 0;
+    
     fclose (inputPointer);
     
     
@@ -133,6 +250,9 @@ int main() {
         // increment the program counter
         PC = PC + 1;
         
+        if (sourceProfile)
+            clock_gettime(CLOCK_MONOTONIC, &started);
+        
         // execute cycle
         switch ( ir.op )
         {
@@ -140,6 +260,10 @@ int main() {
                 reg[ir.r] = ir.m;
                 break;
             case 2: //  RTN
+                if (pendingCount > 0 && pending[pendingCount - 1].frame == basePtr) {
+                    pendingCount--;
+                    rememberCall(&memo[pending[pendingCount].cache], &pending[pendingCount], stack);
+                }
                 stackPtr = basePtr - 1;
                 basePtr = stack[stackPtr + 3];
                 PC = stack[stackPtr + 4];
@@ -152,6 +276,10 @@ int main() {
                 stack[ base(ir.l, basePtr, stack) + ir.m] = reg[ir.r];
                 break;
             case 5: // CAL
+                if ( ! bounded && stackPtr + 4 >= stackHeight) {
+                    printf("Stack overflow.\n");
+                    exit(1);
+                }
                 stack[stackPtr + 1] = 0;
                 stack[stackPtr + 2] = base(ir.l, basePtr, stack);
                 stack[stackPtr + 3] = basePtr;
@@ -160,6 +288,10 @@ int main() {
                 PC = ir.m;
                 break;
             case 6: // INC
+                if ( ! bounded && stackPtr + ir.m >= stackHeight) {
+                    printf("Stack overflow.\n");
+                    exit(1);
+                }
                 stackPtr = stackPtr + ir.m;
                 ActRecLen[curActRec+1]=ir.m + ActRecLen[curActRec];
                 curActRec++;
@@ -198,7 +330,7 @@ int main() {
                 reg[ir.r] = reg[ir.l] / reg[ir.m];
                 break;
             case 17:    // ODD
-                reg[ir.r] = reg[ir.r] % 2;
+                reg[ir.r] = reg[ir.l] % 2;
                 break;
             case 18:    // MOD
                 reg[ir.r] = reg[ir.l] % reg[ir.m];
@@ -221,6 +353,188 @@ int main() {
             case 24:    // GEQ
                 reg[ir.r] = reg[ir.l] >= reg[ir.m];
                 break;
+            case 25:    // JPT
+                if ( reg[ir.r] != 0 ){
+                    PC = ir.m;
+                }
+                break;
+            case 26:    // SHL, shift count in M
+                reg[ir.r] = (int)( (unsigned int) reg[ir.l] << ir.m );
+                break;
+            case 27:    // SHR, arithmetic, shift count in M
+                reg[ir.r] = reg[ir.l] >> ir.m;
+                break;
+            case 28:    // AND, mask in M
+                reg[ir.r] = reg[ir.l] & ir.m;
+                break;
+            case 29:    // MLH, high word of the product with M
+                reg[ir.r] = (int)( ( (long long) reg[ir.l] * ir.m ) >> 32 );
+                break;
+            case 30:    // LDL, current frame
+                reg[ir.r] = stack[ basePtr + ir.m ];
+                break;
+            case 31:    // STL
+                stack[ basePtr + ir.m ] = reg[ir.r];
+                break;
+            case 32:    // LDP, frame one static link up
+                reg[ir.r] = stack[ stack[basePtr + 1] + ir.m ];
+                break;
+            case 33:    // STP
+                stack[ stack[basePtr + 1] + ir.m ] = reg[ir.r];
+                break;
+            case 34:    // LDG, absolute address in M
+                reg[ir.r] = stack[ ir.m ];
+                break;
+            case 35:    // STG
+                stack[ ir.m ] = reg[ir.r];
+                break;
+            case 36:    // ADDI, immediate in M
+                reg[ir.r] = reg[ir.l] + ir.m;
+                break;
+            case 37:    // SUBI
+                reg[ir.r] = reg[ir.l] - ir.m;
+                break;
+            case 38:    // MULI
+                reg[ir.r] = reg[ir.l] * ir.m;
+                break;
+            case 39:    // EQLI
+                reg[ir.r] = reg[ir.l] == ir.m;
+                break;
+            case 40:    // NEQI
+                reg[ir.r] = reg[ir.l] != ir.m;
+                break;
+            case 41:    // LSSI
+                reg[ir.r] = reg[ir.l] < ir.m;
+                break;
+            case 42:    // LEQI
+                reg[ir.r] = reg[ir.l] <= ir.m;
+                break;
+            case 43:    // GTRI
+                reg[ir.r] = reg[ir.l] > ir.m;
+                break;
+            case 44:    // GEQI
+                reg[ir.r] = reg[ir.l] >= ir.m;
+                break;
+            case 45:    // ADDM, operand from the current frame at M
+                reg[ir.r] = reg[ir.l] + stack[ basePtr + ir.m ];
+                break;
+            case 46:    // SUBM
+                reg[ir.r] = reg[ir.l] - stack[ basePtr + ir.m ];
+                break;
+            case 47:    // MULM
+                reg[ir.r] = reg[ir.l] * stack[ basePtr + ir.m ];
+                break;
+            case 48:    // BEQ, compare R with L and jump to M
+                if ( reg[ir.r] == reg[ir.l] ){
+                    PC = ir.m;
+                }
+                break;
+            case 49:    // BNE
+                if ( reg[ir.r] != reg[ir.l] ){
+                    PC = ir.m;
+                }
+                break;
+            case 50:    // BLT
+                if ( reg[ir.r] < reg[ir.l] ){
+                    PC = ir.m;
+                }
+                break;
+            case 51:    // BLE
+                if ( reg[ir.r] <= reg[ir.l] ){
+                    PC = ir.m;
+                }
+                break;
+            case 52:    // BGT
+                if ( reg[ir.r] > reg[ir.l] ){
+                    PC = ir.m;
+                }
+                break;
+            case 53:    // BGE
+                if ( reg[ir.r] >= reg[ir.l] ){
+                    PC = ir.m;
+                }
+                break;
+            case 54:    // TCL, call M in place of the current frame, which keeps its return address
+                stack[basePtr] = 0;
+                stack[basePtr + 1] = base(ir.l, basePtr, stack);
+                stackPtr = basePtr - 1;
+                PC = ir.m;
+                curActRec--;
+                break;
+            case 55:    // LCL, call M keeping only the return address, the callee runs in the frame L levels up
+                linkPC = PC;
+                linkBase = basePtr;
+                basePtr = base(ir.l, basePtr, stack);
+                PC = ir.m;
+                break;
+            case 56:    // LRT
+                basePtr = linkBase;
+                PC = linkPC;
+                break;
+            case 57:    // ADR, address of word M in the frame L levels up
+                reg[ir.r] = base(ir.l, basePtr, stack) + ir.m;
+                break;
+            case 58:    // CHK, index R must be below M
+                if (reg[ir.r] < 0 || reg[ir.r] >= ir.m) {
+                    printf("Array index out of bounds.\n");
+                    exit(1);
+                }
+                break;
+            case 59:    // LDX, load the word at address L plus index M
+                reg[ir.r] = stack[reg[ir.l] + reg[ir.m]];
+                break;
+            case 60:    // STX
+                stack[reg[ir.l] + reg[ir.m]] = reg[ir.r];
+                break;
+            case 61:    // FIL, set M words from address R to L
+                fillWords(stack + reg[ir.r], reg[ir.l], reg[ir.m]);
+                break;
+            case 62:    // CPY, copy M words from address L to address R
+                if (reg[ir.m] > 0)
+                    memmove(stack + reg[ir.r], stack + reg[ir.l], reg[ir.m] * sizeof(int));
+                break;
+            case 63:    // VAD, add M words from address L to those from address R
+                addWords(stack + reg[ir.r], stack + reg[ir.l], reg[ir.m]);
+                break;
+            case 64:    // SUM, total of M words from address L
+                reg[ir.r] = sumWords(stack + reg[ir.l], reg[ir.m]);
+                break;
+            case 65:    // LOP, count R up by one and jump to M while it is at most L
+                reg[ir.r]++;
+                if ( reg[ir.r] <= reg[ir.l] ){
+                    PC = ir.m;
+                }
+                break;
+            case 66:    // MCL, CAL M unless cache R holds a call that found the same values, whose writes are redone
+                if (recallCall(&memo[ir.r - 1], base(ir.l, basePtr, stack), stack, &call))
+                    break;
+                if (pendingCount < recordCount) {
+                    call.frame = stackPtr + 1;
+                    call.cache = ir.r - 1;
+                    pending[pendingCount++] = call;
+                }
+                if ( ! bounded && stackPtr + 4 >= stackHeight) {
+                    printf("Stack overflow.\n");
+                    exit(1);
+                }
+                stack[stackPtr + 1] = 0;
+                stack[stackPtr + 2] = base(ir.l, basePtr, stack);
+                stack[stackPtr + 3] = basePtr;
+                stack[stackPtr + 4] = PC;
+                basePtr = stackPtr + 1;
+                PC = ir.m;
+                break;
+            case 67:    // JAL, call M in the frame fixed at R, which takes the links in place of the stack
+                stack[ir.r + 1] = base(ir.l, basePtr, stack);
+                stack[ir.r + 2] = basePtr;
+                stack[ir.r + 3] = PC;
+                basePtr = ir.r;
+                PC = ir.m;
+                break;
+            case 68:    // JRT, return from a fixed frame, leaving the stack as it is
+                PC = stack[basePtr + 3];
+                basePtr = stack[basePtr + 2];
+                break;
             default:
                 printf("Invalid op code.\n");
                 exit(1);
@@ -228,6 +542,19 @@ int main() {
         }
         
         
+        if (sourceProfile) {
+            long long time = elapsed(&started) - clockCost;
+            spent[line] += time > 0 ? time : 0;
+        }
+        
+        if (profile || sourceProfile) {
+            executed[line]++;
+            
+            if (isConditionalJump(ir.op) && PC != line + 1)
+                taken[line]++;
+        }
+        
+        
         fprintf(outputPointer, "%d\t", line );
         fprintf(outputPointer, "%s\t", getOpCode(ir.op) );
         fprintf(outputPointer, "%d\t", ir.r);
@@ -258,10 +585,170 @@ int main() {
     
     
     fclose(outputPointer);
+    
+    if (profile) {
+        outputProfileToFile(executed, taken, codeLen);
+    }
+    
+    if (sourceProfile) {
+        outputSourceProfile(executed, spent, codeLen);
+    }
+    
+    for (i = 0; i < memoCount; i++) {
+        free(memo[i].rows);
+    }
+    
+    free(stack);
+    free(reg);
+    free(ActRecLen);
+    free(memo);
+    free(pending);
+    
     return 0;
 }
 
 
+// Whether an opcode is JPC, JPT, LOP or one of the compare and branch opcodes
+int isConditionalJump(int op) {
+    
+    return op == 8 || op == 25 || (op >= 48 && op <= 53) || op == 65;
+}
+
+
+// One line per instruction: line, times executed, times the jump was taken
+void outputProfileToFile(long* executed, long* taken, int codeLength) {
+    
+    FILE* ofp = fopen("profile.txt", "w");
+    
+    for (int i = 0; i < codeLength; i++) {
+        fprintf(ofp, "%d %ld %ld\n", i, executed[i], taken[i]);
+    }
+    
+    fclose(ofp);
+}
+
+
+// Nanoseconds since from
+long long elapsed(struct timespec* from) {
+    
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return (now.tv_sec - from->tv_sec) * 1000000000LL + now.tv_nsec - from->tv_nsec;
+}
+
+
+// The source annotated with the instructions run and the microseconds spent on each line, then the same
+// for each procedure. lines.txt holds where each procedure starts, then the line each run of code came from
+void outputSourceProfile(long* executed, long long* spent, int codeLength) {
+    
+    FILE* table = fopen("lines.txt", "r");
+    FILE* source = fopen("input.txt", "r");
+    int procedures, runs;
+    
+    if ( ! table || ! source || fscanf(table, "%d %d", &procedures, &runs) != 2) {
+        printf("Source profile needs lines.txt and input.txt\n");
+        return;
+    }
+    
+    int* start = malloc((procedures + 1) * sizeof(int));
+    char (*name)[16] = malloc((procedures + 1) * sizeof(*name));
+    int lineOf[MAX_CODE_LENGTH] = { 0 };
+    int pc, line = 0, last = 0;
+    
+    for (int p = 0; p < procedures; p++) {
+        fscanf(table, "%d %15s", &start[p], name[p]);
+    }
+    
+    for (int r = 0; r <= runs; r++) {
+        
+        int next = codeLength;
+        int nextLine = 0;
+        
+        if (r < runs && fscanf(table, "%d %d", &next, &nextLine) != 2)
+            next = codeLength;
+        
+        for (; last < next && last < codeLength; last++) {
+            lineOf[last] = line;
+        }
+        
+        line = nextLine;
+    }
+    
+    fclose(table);
+    
+    // Source lines, one string each
+    char** text = NULL;
+    int lineCount = 0;
+    char* buffer = NULL;
+    size_t size = 0;
+    
+    while (getline(&buffer, &size, source) > 0) {
+        
+        buffer[strcspn(buffer, "\r\n")] = '\0';
+        text = realloc(text, (lineCount + 1) * sizeof(char*));
+        text[lineCount++] = strdup(buffer);
+    }
+    
+    free(buffer);
+    fclose(source);
+    
+    long* lineRuns = calloc(lineCount + 1, sizeof(long));
+    long long* lineTime = calloc(lineCount + 1, sizeof(long long));
+    long* procedureRuns = calloc(procedures + 1, sizeof(long));
+    long long* procedureTime = calloc(procedures + 1, sizeof(long long));
+    long long total = 0;
+    int p = 0;
+    
+    for (pc = 0; pc < codeLength; pc++) {
+        
+        while (p + 1 < procedures && start[p + 1] <= pc) p++;
+        
+        if (lineOf[pc] >= 1 && lineOf[pc] <= lineCount) {
+            lineRuns[lineOf[pc] - 1] += executed[pc];
+            lineTime[lineOf[pc] - 1] += spent[pc];
+        }
+        
+        procedureRuns[p] += executed[pc];
+        procedureTime[p] += spent[pc];
+        total += spent[pc];
+    }
+    
+    FILE* ofp = fopen("sourceprofile.txt", "w");
+    
+    fprintf(ofp, "Source profile, instructions run and microseconds spent per line:\n\n");
+    fprintf(ofp, "%12s %12s %6s\n", "count", "usec", "line");
+    
+    for (int l = 0; l < lineCount; l++) {
+        if (lineRuns[l] > 0)
+            fprintf(ofp, "%12ld %12.1f %6d  %s\n", lineRuns[l], lineTime[l] / 1000.0, l + 1, text[l]);
+        else
+            fprintf(ofp, "%12s %12s %6d  %s\n", "", "", l + 1, text[l]);
+        
+        free(text[l]);
+    }
+    
+    fprintf(ofp, "\nProcedures:\n\n");
+    fprintf(ofp, "%12s %12s %6s  %s\n", "count", "usec", "%", "name");
+    
+    for (p = 0; p < procedures; p++) {
+        fprintf(ofp, "%12ld %12.1f %6.1f  %s\n", procedureRuns[p], procedureTime[p] / 1000.0,
+                total > 0 ? 100.0 * procedureTime[p] / total : 0.0, name[p]);
+    }
+    
+    fclose(ofp);
+    
+    free(text);
+    free(start);
+    free(name);
+    free(lineRuns);
+    free(lineTime);
+    free(procedureRuns);
+    free(procedureTime);
+}
+
+
 void outputCodeToFile(FILE* ofp, int code[][MAX_CODE_LENGTH], int codeLength) {
     
     fprintf(ofp, "line\tOP\tL\tM\n");
@@ -311,6 +798,109 @@ int base(int l, int base, int* stack) {
 }
 
 
+// The bulk opcodes run LANES words per step, words are copied in and out of the vectors
+// as nothing keeps the stack aligned to them, and the last few are done one at a time
+void fillWords(int* to, int value, int count) {
+    
+    lanes v = { 0 };
+    int i = 0;
+    
+    v += (unsigned int)value;
+    
+    for (; i + LANES <= count; i += LANES) {
+        memcpy(to + i, &v, sizeof(v));
+    }
+    
+    for (; i < count; i++) {
+        to[i] = value;
+    }
+}
+
+void addWords(int* to, int* from, int count) {
+    
+    lanes a, b;
+    int i = 0;
+    
+    for (; i + LANES <= count; i += LANES) {
+        memcpy(&a, to + i, sizeof(a));
+        memcpy(&b, from + i, sizeof(b));
+        a += b;
+        memcpy(to + i, &a, sizeof(a));
+    }
+    
+    for (; i < count; i++) {
+        to[i] = (unsigned int)to[i] + (unsigned int)from[i];
+    }
+}
+
+int sumWords(int* from, int count) {
+    
+    lanes total = { 0 };
+    lanes v;
+    unsigned int sum = 0;
+    int i = 0;
+    
+    for (; i + LANES <= count; i += LANES) {
+        memcpy(&v, from + i, sizeof(v));
+        total += v;
+    }
+    
+    for (int k = 0; k < LANES; k++) {
+        sum += total[k];
+    }
+    
+    for (; i < count; i++) {
+        sum += (unsigned int)from[i];
+    }
+    
+    return (int)sum;
+}
+
+
+// Look a call up in its cache, by what the slots it keys on hold now, link being the callee's static link
+// On a hit the writes the call made are redone and 1 returned, on a miss call keeps where the slots are and
+// what they held, for rememberCall() to fill the entry with once the procedure returns
+int recallCall(memoCache* cache, int link, int* stack, pendingCall* call) {
+    
+    unsigned int hash = 0;
+    int k;
+    
+    for (k = 0; k < cache->count; k++) {
+        call->address[k] = base(cache->depth[k] - 1, link, stack) + cache->addr[k];
+        call->key[k] = stack[call->address[k]];
+        hash = hash * 31 + (unsigned int)call->key[k];
+    }
+    
+    call->row = hash % MEMO_ENTRIES;
+    
+    int* row = cache->rows + call->row * (1 + 2 * cache->count);
+    
+    if ( ! row[0] || memcmp(row + 1, call->key, cache->count * sizeof(int)) != 0)
+        return 0;
+    
+    for (k = 0; k < cache->count; k++) {
+        if (cache->written[k])
+            stack[call->address[k]] = row[1 + cache->count + k];
+    }
+    
+    return 1;
+}
+
+
+// Fill the entry of a returning call with what it found and what it left, over any call there before
+void rememberCall(memoCache* cache, pendingCall* call, int* stack) {
+    
+    int* row = cache->rows + call->row * (1 + 2 * cache->count);
+    
+    row[0] = 1;
+    memcpy(row + 1, call->key, cache->count * sizeof(int));
+    
+    for (int k = 0; k < cache->count; k++) {
+        row[1 + cache->count + k] = stack[call->address[k]];
+    }
+}
+
+
 // Convert opcode number to text
 char* getOpCode(int opCode) {
     
@@ -364,6 +954,94 @@ char* getOpCode(int opCode) {
             return "GTR";
         case 24:
             return "GEQ";
+        case 25:
+            return "JPT";
+        case 26:
+            return "SHL";
+        case 27:
+            return "SHR";
+        case 28:
+            return "AND";
+        case 29:
+            return "MLH";
+        case 30:
+            return "LDL";
+        case 31:
+            return "STL";
+        case 32:
+            return "LDP";
+        case 33:
+            return "STP";
+        case 34:
+            return "LDG";
+        case 35:
+            return "STG";
+        case 36:
+            return "ADDI";
+        case 37:
+            return "SUBI";
+        case 38:
+            return "MULI";
+        case 39:
+            return "EQLI";
+        case 40:
+            return "NEQI";
+        case 41:
+            return "LSSI";
+        case 42:
+            return "LEQI";
+        case 43:
+            return "GTRI";
+        case 44:
+            return "GEQI";
+        case 45:
+            return "ADDM";
+        case 46:
+            return "SUBM";
+        case 47:
+            return "MULM";
+        case 48:
+            return "BEQ";
+        case 49:
+            return "BNE";
+        case 50:
+            return "BLT";
+        case 51:
+            return "BLE";
+        case 52:
+            return "BGT";
+        case 53:
+            return "BGE";
+        case 54:
+            return "TCL";
+        case 55:
+            return "LCL";
+        case 56:
+            return "LRT";
+        case 57:
+            return "ADR";
+        case 58:
+            return "CHK";
+        case 59:
+            return "LDX";
+        case 60:
+            return "STX";
+        case 61:
+            return "FIL";
+        case 62:
+            return "CPY";
+        case 63:
+            return "VAD";
+        case 64:
+            return "SUM";
+        case 65:
+            return "LOP";
+        case 66:
+            return "MCL";
+        case 67:
+            return "JAL";
+        case 68:
+            return "JRT";
         
         default:
             return "Error";
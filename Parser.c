@@ -4,27 +4,58 @@
 //  Parser.c
 //  --
 //  Should exit with code 1 for expected errors and -1 for unexpected errors (file I/O)
+//  Runs the Scanner itself and pulls tokens from its output one at a time as the parse needs them
+//  With -p the layout of the code is written to "layout.txt", so that with -f a later compile can read it
+//  back together with the "profile.txt" the PMachine wrote while running that code
 //  --
 
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
 
 
 #define MAX_SYMBOL_TABLE_SIZE 100
 #define MAX_IDENT_LENGTH 11
 #define MAX_NUM_LENGTH 5
 #define CODE_BUFFER 10000
+#define MAX_CODE_LENGTH 500
+#define MAX_PROCEDURES 1000
+#define MAX_SITES CODE_BUFFER
+#define MAX_REGISTERS 16
+#define INLINE_BUDGET 16
+#define HOT_CALLS 100
+#define UNROLL_FACTOR 4
+#define UNROLL_BUDGET 64
+#define EVALUATION_BUDGET 100000
+#define EVALUATION_STACK 2000
+#define EVALUATION_OUTPUTS 64
+#define MAIN_FRAME_BASE 1
+#define MAX_WORKERS 64
+#define MEMO_KEY 8
+#define SCANNER_COMMAND "./Scanner -p"
+
+
+// Register operands of an instruction, see registerFields()
+#define USES_R 1
+#define USES_L 2
+#define USES_M 4
+#define DEFINES_R 8
+
+#define bitsetWords(size) (((size) + 31) / 32)
 
 
 // Symbol table struct
 typedef struct {
-    int kind;           // const = 1, var = 2, procedure = 3
+    int kind;           // const = 1, var = 2, procedure = 3, array = 4
     char name[12];      // name of identifier
     int val;            // value for constants / numbers
     int level;          // L level
     int addr;           // M address
+    int size;           // number of elements for arrays
 } symbol;
 
 
@@ -62,7 +93,11 @@ typedef enum {
     procsym = 30,
     writesym = 31,
     readsym = 32,
-    elsesym = 33
+    elsesym = 33,
+    lbracketsym = 34,
+    rbracketsym = 35,
+    forsym = 36,
+    tosym = 37
 } token_type;
 
 
@@ -91,7 +126,51 @@ typedef enum {
     LSS,
     LEQ,
     GTR,
-    GEQ
+    GEQ,
+    JPT,
+    SHL,
+    SHR,
+    AND,
+    MLH,
+    LDL,
+    STL,
+    LDP,
+    STP,
+    LDG,
+    STG,
+    ADDI,
+    SUBI,
+    MULI,
+    EQLI,
+    NEQI,
+    LSSI,
+    LEQI,
+    GTRI,
+    GEQI,
+    ADDM,
+    SUBM,
+    MULM,
+    BEQ,
+    BNE,
+    BLT,
+    BLE,
+    BGT,
+    BGE,
+    TCL,
+    LCL,
+    LRT,
+    ADR,
+    CHK,
+    LDX,
+    STX,
+    FIL,
+    CPY,
+    VAD,
+    SUM,
+    LOP,
+    MCL,
+    JAL,
+    JRT
 } op_code;
 
 
@@ -99,99 +178,406 @@ typedef enum {
 typedef enum {
     constant = 1,
     variable,
-    procedure
+    procedure,
+    array
 } symbol_kind;
 
 
-// Node to represent a token
-typedef struct node {
-    int token;
-    struct node *next;
-} node;
-
 // Struct to hold an instruction
 typedef struct {
     int op;
     int r;
     int l;
     int m;
+    int site;   // JPCs as parsed are numbered from 1, negated once the jump is inverted
+    int line;   // source line it was parsed from, 0 for code the optimizer made up
 } instruction;
 
+// Code for one procedure body, the main block is unit 0
+// Registers are virtual until allocateRegisters() maps them onto the PM/0 register file
+typedef struct {
+    instruction* code;  // body code, starting with its INC
+    int length;
+    int capacity;
+    int level;          // L level of the body
+    int parent;         // unit the procedure is declared in, -1 for the main block
+    int registerCount;  // number of virtual registers
+    int reachable;      // called, directly or not, from the main block
+} procedureUnit;
+
+// A variable's home in a frame, as addressed by LOD and STO from within one unit
+typedef struct {
+    int l;
+    int m;
+} frameSlot;
+
+// A straight line run of code with a single entry, [start, end)
+typedef struct {
+    int start;
+    int end;
+    int successors[2];
+    int successorCount;
+} basicBlock;
+
+// An operation on value numbers available from the block defining reg
+typedef struct {
+    int op;
+    int a;
+    int b;
+    int reg;
+    int block;
+} valueExpression;
+
+// What a frame slot is known to hold at some point, see propagateSlots()
+typedef enum {
+    SLOT_UNKNOWN,       // no path seen yet
+    SLOT_CONSTANT,      // the constant value
+    SLOT_COPY,          // whatever register value holds
+    SLOT_VARYING
+} slot_kind;
+
+typedef struct {
+    int kind;
+    int value;
+} slotValue;
+
+// A suspended caller while evaluateProgram() runs a call
+typedef struct {
+    int unit;
+    int returnAddress;
+    int* regs;
+} activation;
+
+// Units handed out to the workers of runWorkers() one at a time
+typedef struct {
+    void (*stage)(procedureUnit* unit);
+    int next;
+    pthread_mutex_t lock;
+} unitQueue;
+
+typedef unsigned int* bitset;
+
 
 // Functions
 //
 // Functions for processing
-void program(node* currentNode);
-void block(node* currentNode);
-int constantDeclaration(node* currentNode);
-int variableDeclaration(node* currentNode);
-int procedureDeclaration(node* currentNode);
-void statement(node* currentNode);
-void condition(node* currentNode);
+void program();
+void block();
+int constantDeclaration();
+int variableDeclaration(int* space);
+int arraySize();
+int arrayElement(int index, int* base);
+int procedureDeclaration();
+void statement();
+int condition();
 int relOp();
-void expression(node* currentNode);
-void checkCode(node* currentNode);
-void factor(node* currentNode);
-void nextLexeme(node* currentNode);
+int expression();
+int checkCode();
+int factor();
+void nextLexeme();
 void reportError(int errorType);
 void addtoSymbolTable(int symbolKind, int symListIndex);
 int findToken(int token);
 //
 // Helper functions
-node* newNode(int data);
-node* insertNode(node* head, node* tail, int token);
-node* getLexemeList();
-int getSymbolList(symbol* st);
+void openScanner();
+void closeScanner();
+int newUnit();
+int newRegister();
 void storeCode(int op, int r, int l, int m);
+void appendCode(procedureUnit* unit, instruction in);
+int duplicateCode(procedureUnit* unit, int start, int end, int reg);
+void countProgram();
+int growProgram(int words);
+void linkUnits();
 void outputCodeToFile();
+void outputLineTable();
+//
+// Register allocation
+int registerFields(int op);
+int findBasicBlocks(procedureUnit* unit, basicBlock* blocks, int* blockOf);
+void computeLiveness(procedureUnit* unit, basicBlock* blocks, int blockCount, bitset* liveOut);
+void allocateRegisters(procedureUnit* unit);
+int colorRegisters(procedureUnit* unit, int* color, char* spilled, char* unspillable);
+void spillRegisters(procedureUnit* unit, char* spilled, char** unspillable);
+void fuseCounters(procedureUnit* unit);
+void relocateJumps(procedureUnit* unit, int* newIndex);
+int isJump(int op);
+int instructionUses(instruction in, int* regs);
+int instructionDefines(instruction in);
+bitset newBitset(long size);
+void setBit(bitset set, long bit);
+void clearBit(bitset set, long bit);
+int testBit(bitset set, long bit);
+//
+// Optimization
+void optimizeUnit(procedureUnit* unit);
+int foldConstants(procedureUnit* unit);
+int numberValues(procedureUnit* unit);
+int propagateSlots(procedureUnit* unit);
+void slotsIn(basicBlock* blocks, int* order, int orderCount, int b, slotValue* out, int slotCount, slotValue* state);
+int transferSlots(procedureUnit* unit, basicBlock* block, slotValue* state, frameSlot* slots, int slotCount,
+                  char* isConstant, int* constant, int* replacement, char* removed);
+int reversePostorder(basicBlock* blocks, int blockCount, int* order);
+void computeDominators(basicBlock* blocks, int blockCount, int* order, int orderCount, bitset* dominators);
+int evaluateOperation(int op, int a, int b, int* value);
+int reduceStrength(procedureUnit* unit);
+int divideByConstant(procedureUnit* unit, int dividend, int divisor, int nonNegative);
+void divisionMagic(int divisor, int* multiplier, int* shift);
+int emitOperation(procedureUnit* unit, int op, int l, int m);
+int removeUnreachableCode(procedureUnit* unit);
+int hoistLoopInvariants(procedureUnit* unit);
+int hoistLoop(procedureUnit* unit, int head, int tail);
+int eliminateDeadStores(procedureUnit* unit);
+void liveSlotsOut(basicBlock* block, bitset* liveIn, bitset live, int words);
+void liveSlotsBackward(procedureUnit* unit, basicBlock* block, bitset live, frameSlot* slots, int slotCount,
+                       bitset upLevel, bitset all, char* removed);
+int eliminateDeadCode(procedureUnit* unit);
+void compactCode(procedureUnit* unit, char* removed);
+int collectSlots(procedureUnit* unit, frameSlot** slots);
+int slotIndex(frameSlot* slots, int slotCount, int l, int m);
+void markReachableUnits();
+void inlineProcedures();
+void orderCallees(int unit, char* visited, int* order, int* count);
+int callsUnit(int from, int target, char* visited);
+int canInline(int callee, char* recursive);
+int inlineCalls(procedureUnit* caller, char* recursive);
+void specializeAccesses(procedureUnit* unit);
+int unrollLoops(procedureUnit* unit);
+int unrollLoop(procedureUnit* unit, int head, int tail);
+int entryValue(procedureUnit* unit, int head, int l, int m, int* value);
+int escapesLoop(procedureUnit* unit, int head, int tail, int* definition, int closing);
+int exitStore(procedureUnit* unit, int head, int tail, int reg, int closing);
+int holdsRelation(int relation, long long a, long long b);
+void unrollCompletely(procedureUnit* unit, int head, int tail, int trips);
+void unrollByFactor(procedureUnit* unit, int head, int tail, int factor, int compare, instruction slot,
+                    int relation, int bound, int constantBound, int value, int ahead, int* definition, int closing);
+int copyLoopBody(procedureUnit* unit, procedureUnit* middle, int head, int tail, int rename,
+                 int compare, int bound, int near);
+void spliceLoop(procedureUnit* unit, procedureUnit* middle, int head, int tail);
+void appendInstruction(procedureUnit* unit, int op, int r, int l, int m);
+int vectorizeLoops(procedureUnit* unit);
+int vectorizeLoop(procedureUnit* unit, int head, int tail);
+int isInvariant(procedureUnit* unit, int head, int tail, int* definition, int reg);
+int sameArray(procedureUnit* unit, int* definition, int a, int b);
+//
+// Tail calls
+int eliminateTailCalls(procedureUnit* unit);
+//
+// Side effects of calls
+void summarizeEffects();
+int summarizeUnit(int unit);
+int effectSlot(int level, int addr);
+int callTouches(procedureUnit* unit, instruction call, int l, int m, int writes);
+int callsChange(procedureUnit* unit, int start, int end, int l, int m);
+//
+// Stages run on every unit in parallel
+void runWorkers(void (*stage)(procedureUnit* unit));
+void* unitWorker(void* queue);
+void optimizeLoops(procedureUnit* unit);
+void generateUnit(procedureUnit* unit);
+//
+// Leaf procedures
+void useLeafFrames();
+int isLeaf(int unit, char* tailCalled);
+//
+// Memoization
+void memoizeCalls();
+int initializesLocals(procedureUnit* unit);
+int storesLocals(procedureUnit* unit, basicBlock* block, bitset stored, int size);
+int memoKey(int unit, bitset only);
+//
+// Static frames
+void useStaticFrames();
+int frameOwner(int unit, int l);
+//
+// Static bounds of the running program
+void measureProgram();
+int measureUnit(int unit, int* need, int* records, char* state);
+//
+// Compile time evaluation
+void evaluateProgram();
+int evaluationBase(int* memory, int l, int bp);
+int evaluateBulk(instruction in, int* regs, int* memory, char* written);
+void findCleanPoints(procedureUnit* unit, char* clean);
+void restartProgram(int resume, int* outputs, int outputCount, int* frame, int steps);
+//
+// Profile guided layout
+void readProfile();
+void layoutBranches(procedureUnit* unit);
+void outlineRegion(procedureUnit* unit, int jump, int start, int end, int removed, int resume);
+//
+// Instruction selection
+void selectInstructions(procedureUnit* unit);
+void countDefinitions(procedureUnit* unit, int* definition, int* uses);
+void fuseBranches(procedureUnit* unit);
+void useImmediates(procedureUnit* unit);
+void useMemoryOperands(procedureUnit* unit);
+int canReadDirectly(procedureUnit* unit, int reg, int use, int* definition, int* uses, int* blockOf);
+int promoteScalars(procedureUnit* unit);
+int promoteLoop(procedureUnit* unit, int head, int tail);
+void promoteSlot(procedureUnit* unit, int head, int tail, int l, int m);
+void coalesceMoves(procedureUnit* unit, int head, int tail, int promoted);
+int renameReads(procedureUnit* unit, int start, int end, int reg, int promoted, int count, char* removed);
 //
 //
 // Global variables
 //
 int currentToken;
-int currentRegister;
-symbol symbolList[50];
+symbol symbolList[MAX_SYMBOL_TABLE_SIZE];
+FILE* lexer;
+int pendingIndex;
+int tokenLine;      // where the current token starts
+int tokenColumn;
+int lastLine;       // line of the token before it, the last one parsed
 symbol symbolTable[100];
 int symbolTableIndex;
 int codeLine;
 instruction code[CODE_BUFFER];
+int programLength;      // instructions in every unit, kept under what the PMachine can hold
+pthread_mutex_t programLock = PTHREAD_MUTEX_INITIALIZER;
+procedureUnit units[MAX_PROCEDURES];
+int unitCount;
+int currentUnit;
 int printSuccess;
 int level;
+int inlineBudget;
+int evaluationBudget;
+int unrollFactor;
+int workerCount;
+int registerBound;
+int stackBound;
+int recordBound;
+int siteCount;
+int writeLayout;
+int useProfile;
+int profiled;
+char unitProfiled[MAX_PROCEDURES];
+long unitCalls[MAX_PROCEDURES];
+long siteRuns[MAX_SITES];
+long siteTaken[MAX_SITES];
+int siteUnit[MAX_SITES];
+int codeUnit[CODE_BUFFER];
+char unitName[MAX_PROCEDURES][MAX_IDENT_LENGTH + 1];
+frameSlot* effectSlots;     // slots named anywhere, l is their level counted from the main block
+int effectSlotCount;
+bitset unitReads[MAX_PROCEDURES];
+bitset unitWrites[MAX_PROCEDURES];
+char unitAddresses[MAX_PROCEDURES];
+char unitInput[MAX_PROCEDURES];
+char unitOutput[MAX_PROCEDURES];    // writes a value or halts
+int memoize;
+int memoTable[MAX_PROCEDURES];      // cache the PMachine keeps for the procedure, numbered from 1, 0 for none
+int memoCount;
+char leafUnit[MAX_PROCEDURES];
+int staticFrame[MAX_PROCEDURES];    // address of the procedure's frame when it is fixed, 0 when it is not
 
 //
 int main(int argc, char* argv[]) {
     
     // Initialize globals that need it
-    currentRegister = -1;
     level = -1;
+    pendingIndex = -1;
+    inlineBudget = INLINE_BUDGET;
+    evaluationBudget = EVALUATION_BUDGET;
+    unrollFactor = UNROLL_FACTOR;
+    workerCount = sysconf(_SC_NPROCESSORS_ONLN);
     
     
-    if (argc > 1) {
-        printSuccess = 1;
+    for (int i = 1; i < argc; i++) {
+        
+        if (strcmp(argv[i], "-a") == 0) {
+            printSuccess = 1;
+        }
+        
+        // Largest procedure body, in instructions, substituted at its call sites
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            inlineBudget = atoi(argv[++i]);
+        }
+        
+        // Most instructions run at compile time before the rest is left to the PMachine
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            evaluationBudget = atoi(argv[++i]);
+        }
+        
+        // Copies of the body per iteration of an unrolled loop, 1 only unrolls small loops completely
+        else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            unrollFactor = atoi(argv[++i]);
+        }
+        
+        // Threads the units are optimized on, 1 does it all on this one
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            workerCount = atoi(argv[++i]);
+        }
+        
+        else if (strcmp(argv[i], "-p") == 0) {
+            writeLayout = 1;
+        }
+        
+        else if (strcmp(argv[i], "-f") == 0) {
+            useProfile = 1;
+        }
+        
+        else if (strcmp(argv[i], "-m") == 0) {
+            memoize = 1;
+        }
     }
     
     
-    // Retrieve the lexemelist and store it
-    node* currentNode;
-    currentNode = getLexemeList();
-    
-    // Retrieve the symbol table and store it
-    getSymbolList(symbolList);
+    // Tokens are pulled from the Scanner as the parse needs them
+    openScanner();
     
     // Begin processing
-    program(currentNode);
+    program();
+    closeScanner();
+    
+    if (useProfile)
+        readProfile();
+    
+    summarizeEffects();
+    
+    // Units only read each other while inlining and evaluating, everything else runs on one unit at a time
+    runWorkers(optimizeUnit);
+    
+    if (inlineBudget > 0)
+        inlineProcedures();
+    
+    countProgram();
+    runWorkers(optimizeLoops);
+    
+    if (evaluationBudget > 0)
+        evaluateProgram();
+    
+    markReachableUnits();
+    
+    runWorkers(generateUnit);
+    
+    if (memoize)
+        memoizeCalls();
+    
+    useLeafFrames();
+    useStaticFrames();
+    
+    for (int i = 0; i < unitCount; i++) {
+        if (units[i].reachable)
+            specializeAccesses(&units[i]);
+    }
+    
+    measureProgram();
+    linkUnits();
     outputCodeToFile();
+    outputLineTable();
     
     
     return 0;
 }
 
 //
-void program(node* currentNode) {
+void program() {
     
-    nextLexeme(currentNode);
+    nextLexeme();
     
-    block(currentNode);
+    block();
     
     // Error for missing period
     if (currentToken != periodsym) {
@@ -207,45 +593,42 @@ void program(node* currentNode) {
 }
 
 //
-void block(node* currentNode) {
+void block() {
     
     int space;
     int numberOfConstants = 0;
     int numberOfVars = 0;
     int numberOfProcs = 0;
-    int jmpAddress;
+    int unit;
     
     level++;
     
     space = 4;
     
-    jmpAddress = codeLine;
-    
-    storeCode(JMP, 0, 0, 0);
+    // Nested procedures are generated into units of their own, so no jump around them is needed
+    unit = newUnit();
     
     // Checks current token to call the matching function
     //
     // constsym
     if (currentToken == constsym)
-        numberOfConstants = constantDeclaration(currentNode);
+        numberOfConstants = constantDeclaration();
     
     // varsym
     if (currentToken == varsym) {
-        numberOfVars = variableDeclaration( currentNode );
+        numberOfVars = variableDeclaration(&space);
     }
     
-    space += numberOfVars;
-    
     // procsym
     if (currentToken == procsym) {
-        numberOfProcs = procedureDeclaration( currentNode );
+        numberOfProcs = procedureDeclaration();
     }
     
-    code[jmpAddress].m = codeLine;
+    currentUnit = unit;
     
     storeCode(INC, 0, 0 , space);
     
-    statement(currentNode);
+    statement();
     
     symbolTableIndex = symbolTableIndex - (numberOfVars + numberOfProcs + numberOfConstants);
     
@@ -256,7 +639,7 @@ void block(node* currentNode) {
 }
 
 //
-int constantDeclaration(node* currentNode) {
+int constantDeclaration() {
     
     int symListIndex;
     int constantIndex;
@@ -266,13 +649,13 @@ int constantDeclaration(node* currentNode) {
     // Get constants
     do {
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
         if (currentToken != identsym) {
             reportError(4);
         }
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
         
         symListIndex = currentToken;
@@ -280,7 +663,7 @@ int constantDeclaration(node* currentNode) {
         constantCount++;
         
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
         if (currentToken != eqlsym) {
             
@@ -291,21 +674,21 @@ int constantDeclaration(node* currentNode) {
             else reportError(3);
         }
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
         if (currentToken != numbersym) {
             reportError(2);
         }
         
         // Assign value of the constant
-        nextLexeme(currentNode);
+        nextLexeme();
         
         constantIndex = currentToken;
         constantValue = atoi(symbolList[constantIndex].name);
         
         symbolTable[symbolTableIndex].val = constantValue;
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
     } while (currentToken == commasym);
     
@@ -314,54 +697,134 @@ int constantDeclaration(node* currentNode) {
         reportError(5);
     }
     
-    nextLexeme(currentNode);
+    nextLexeme();
     
     
     return constantCount;
 }
 
 
-//
-int variableDeclaration(node* currentNode) {
+// Adds the words the variables take to space, returns how many were declared
+int variableDeclaration(int* space) {
     
     int symListIndex;
     int variableCount = 0;
+    int scalarCount = 0;
     
     // Get variables
     do {
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
         if (currentToken != identsym) {
             reportError(4);
         }
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
         symListIndex = currentToken;
         
         addtoSymbolTable(variable, symListIndex);
-        symbolTable[symbolTableIndex].addr = 4 + variableCount;
         
-        nextLexeme(currentNode);
+        nextLexeme();
+        
+        if (currentToken == lbracketsym) {
+            symbolTable[symbolTableIndex].kind = array;
+            symbolTable[symbolTableIndex].size = arraySize();
+        }
+        else {
+            symbolTable[symbolTableIndex].addr = *space + scalarCount++;
+        }
         
         variableCount++;
         
     } while (currentToken == commasym);
     
+    *space += scalarCount;
+    
+    // Arrays follow the scalars, their elements are only ever reached through an ADR
+    for (int i = symbolTableIndex - variableCount + 1; i <= symbolTableIndex; i++) {
+        if (symbolTable[i].kind == array) {
+            symbolTable[i].addr = *space;
+            *space += symbolTable[i].size;
+        }
+    }
+    
     // Semicolon should be encountered
     if (currentToken != semicolonsym) {
         reportError(5);
     }
     
-    nextLexeme(currentNode);
+    nextLexeme();
     
     
     return variableCount;
 }
 
+// Returns the number of elements between the brackets of an array declaration, a number or a constant
+int arraySize() {
+    
+    int size = 0;
+    int index;
+    
+    nextLexeme();
+    
+    if (currentToken == numbersym) {
+        nextLexeme();
+        size = atoi(symbolList[currentToken].name);
+    }
+    else if (currentToken == identsym) {
+        
+        nextLexeme();
+        index = findToken(currentToken);
+        
+        if (index == 0 || symbolTable[index].kind != constant)
+            reportError(25);
+        
+        size = symbolTable[index].val;
+    }
+    
+    if (size < 1)
+        reportError(25);
+    
+    nextLexeme();
+    
+    if (currentToken != rbracketsym)
+        reportError(26);
+    
+    nextLexeme();
+    
+    return size;
+}
+
+// Parses the bracketed index after the name of an array, returns the register holding the index
+// The index is checked against the bounds and base is set to a register with the address of the array
+int arrayElement(int index, int* base) {
+    
+    int reg;
+    
+    if (currentToken != lbracketsym)
+        reportError(27);
+    
+    nextLexeme();
+    
+    reg = expression();
+    
+    if (currentToken != rbracketsym)
+        reportError(26);
+    
+    nextLexeme();
+    
+    storeCode(CHK, reg, 0, symbolTable[index].size);
+    
+    *base = newRegister();
+    storeCode(ADR, *base, level - symbolTable[index].level, symbolTable[index].addr);
+    
+    return reg;
+}
+
 //
-int procedureDeclaration(node* currentNode) {
+int procedureDeclaration() {
     
     int symListIndex;
     int procedureCount = 0;
@@ -369,38 +832,41 @@ int procedureDeclaration(node* currentNode) {
     do {
         procedureCount++;
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
         if (currentToken != identsym) {
             reportError(4);
         }
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
         symListIndex = currentToken;
         
         addtoSymbolTable(procedure, symListIndex);
         
         symbolTable[symbolTableIndex].level = level;
-        symbolTable[symbolTableIndex].addr = codeLine;
         
-        nextLexeme(currentNode);
+        // Address is the unit the procedure body is generated into, resolved by linkUnits()
+        symbolTable[symbolTableIndex].addr = unitCount;
+        strcpy(unitName[unitCount], symbolList[symListIndex].name);
+        
+        nextLexeme();
         
         // Semicolon should be encountered
         if (currentToken != semicolonsym) {
             reportError(5);
         }
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
-        block(currentNode);
+        block();
         
         // Semicolon should be encountered
         if (currentToken != semicolonsym) {
             reportError(5);
         }
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
     } while (currentToken == procsym);
     
@@ -409,18 +875,25 @@ int procedureDeclaration(node* currentNode) {
 }
 
 //
-void statement(node* currentNode) {
+void statement() {
     
     int i;
     int index;
+    int reg;
     int codeLineTemp;
     int codeLineTemp2;
     int codeLineTemp3;
+    int element = 0;
+    int base = 0;
+    int bound;
+    int counter;
+    int one;
+    procedureUnit* unit = &units[currentUnit];
     
     // identsym
     if (currentToken == identsym) {
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
         i = currentToken;
         
@@ -430,34 +903,39 @@ void statement(node* currentNode) {
             reportError(7);
         }
         
-        if (symbolTable[index].kind != variable )
+        if (symbolTable[index].kind != variable && symbolTable[index].kind != array )
         {
             reportError(8);
         }
         
-        nextLexeme( currentNode );
+        nextLexeme();
+        
+        if (symbolTable[index].kind == array)
+            element = arrayElement(index, &base);
         
         if ( currentToken != becomessym )
             reportError(9);
         
-        nextLexeme( currentNode );
+        nextLexeme();
         
-        expression( currentNode );
+        reg = expression();
         
-        storeCode( STO, currentRegister, level - symbolTable[index].level, symbolTable[index].addr );
-        currentRegister--;
+        if (symbolTable[index].kind == array)
+            storeCode( STX, reg, base, element );
+        else
+            storeCode( STO, reg, level - symbolTable[index].level, symbolTable[index].addr );
         
     }
     
     // callsym
     else if ( currentToken == callsym )
     {
-        nextLexeme( currentNode );
+        nextLexeme();
         
         if ( currentToken != identsym )
             reportError(23);
         
-        nextLexeme( currentNode );
+        nextLexeme();
         
         i = findToken( currentToken );
         
@@ -469,62 +947,61 @@ void statement(node* currentNode) {
         
         storeCode ( CAL, 0, level - symbolTable[i].level, symbolTable[i].addr );
         
-        nextLexeme( currentNode );
+        nextLexeme();
     }
     
     // beginsym
     else if ( currentToken == beginsym )
     {
-        nextLexeme( currentNode );
+        nextLexeme();
         
-        statement( currentNode );
+        statement();
         
         while ( currentToken == semicolonsym )
         {
-            nextLexeme( currentNode );
-            statement( currentNode );
+            nextLexeme();
+            statement();
         }
         
         if ( currentToken != endsym )
             reportError(11);
         
-        nextLexeme( currentNode );
+        nextLexeme();
     }
     
     // ifsym
     else if ( currentToken == ifsym )
     {
-        nextLexeme( currentNode );
+        nextLexeme();
         
-        condition( currentNode );
+        reg = condition();
         
         if ( currentToken != thensym )
             reportError(10);
         
-        nextLexeme( currentNode );
+        nextLexeme();
         
-        codeLineTemp = codeLine;
-        storeCode( JPC, currentRegister, 0, 0 );
-        currentRegister--;
+        codeLineTemp = unit->length;
+        storeCode( JPC, reg, 0, 0 );
         
-        statement( currentNode );
+        statement();
         
         // elsesym
         if ( currentToken == elsesym )
         {
-            nextLexeme( currentNode );
+            nextLexeme();
             
-            codeLineTemp3 = codeLine;
+            codeLineTemp3 = unit->length;
             storeCode (JMP, 0, 0, 0 );
             
-            code[codeLineTemp].m = codeLine;
+            unit->code[codeLineTemp].m = unit->length;
             
-            statement( currentNode );
-            code[codeLineTemp3].m = codeLine;
+            statement();
+            unit->code[codeLineTemp3].m = unit->length;
         }
         else
         {
-            code[codeLineTemp].m = codeLine;
+            unit->code[codeLineTemp].m = unit->length;
         }
         
     }
@@ -532,119 +1009,218 @@ void statement(node* currentNode) {
     // whilesym
     else if ( currentToken == whilesym )
     {
-        codeLineTemp2 = codeLine;
+        codeLineTemp2 = unit->length;
+        
+        nextLexeme();
+        
+        reg = condition();
+        
+        codeLineTemp3 = unit->length;
+        
+        storeCode( JPC, reg, 0, 0 );
+        
+        if ( currentToken != dosym ) {
+            reportError(12);
+        }
+        
+        nextLexeme();
+        
+        statement();
+        
+        // Inverted loop, the guard above runs once and a copy of the condition closes the loop
+        reg = duplicateCode( unit, codeLineTemp2, codeLineTemp3, reg );
+        
+        storeCode( JPT, reg, 0, codeLineTemp3 + 1 );
+        
+        unit->code[codeLineTemp3].m = unit->length;
+        
+    }
+    
+    // forsym
+    else if ( currentToken == forsym )
+    {
+        nextLexeme();
+        
+        if ( currentToken != identsym )
+            reportError(28);
+        
+        nextLexeme();
         
-        nextLexeme( currentNode );
+        index = findToken(currentToken);
         
-        condition( currentNode );
+        if ( index == 0 )
+            reportError(7);
+        
+        if ( symbolTable[index].kind != variable )
+            reportError(28);
+        
+        nextLexeme();
+        
+        if ( currentToken != becomessym )
+            reportError(9);
+        
+        nextLexeme();
+        
+        reg = expression();
+        
+        storeCode( STO, reg, level - symbolTable[index].level, symbolTable[index].addr );
+        
+        if ( currentToken != tosym )
+            reportError(29);
+        
+        nextLexeme();
+        
+        // The bound is evaluated once, before the first iteration
+        bound = expression();
+        
+        codeLineTemp2 = unit->length;
+        
+        counter = newRegister();
+        storeCode( LOD, counter, level - symbolTable[index].level, symbolTable[index].addr );
+        
+        reg = newRegister();
+        storeCode( LEQ, reg, counter, bound );
         
-        codeLineTemp3 = codeLine;
+        codeLineTemp3 = unit->length;
         
-        storeCode( JPC, currentRegister, 0, 0 );
+        storeCode( JPC, reg, 0, 0 );
         
         if ( currentToken != dosym ) {
             reportError(12);
         }
         
-        nextLexeme( currentNode );
+        nextLexeme();
         
-        statement( currentNode );
+        statement();
         
-        storeCode( JMP, 0, 0, codeLineTemp2 );
+        counter = newRegister();
+        storeCode( LOD, counter, level - symbolTable[index].level, symbolTable[index].addr );
         
-        code[codeLineTemp3].m = codeLine;
+        one = newRegister();
+        storeCode( LIT, one, 0, 1 );
+        
+        reg = newRegister();
+        storeCode( ADD, reg, counter, one );
+        storeCode( STO, reg, level - symbolTable[index].level, symbolTable[index].addr );
+        
+        // Inverted like a while loop, the selected code closes it with a single LOP
+        reg = duplicateCode( unit, codeLineTemp2, codeLineTemp3, unit->code[codeLineTemp3].r );
+        
+        storeCode( JPT, reg, 0, codeLineTemp3 + 1 );
+        
+        unit->code[codeLineTemp3].m = unit->length;
         
     }
     
     // readsym
     else if ( currentToken == readsym )
     {
-        nextLexeme( currentNode );
+        nextLexeme();
         
         if ( currentToken != identsym )
         {
             reportError(18);
         }
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
         i = currentToken;
         index = findToken(i);
         
-        if ( symbolTable[index].kind != variable )
+        if ( symbolTable[index].kind != variable && symbolTable[index].kind != array )
         {
             reportError(11);
         }
         
-        currentRegister++;
-        storeCode( SIO2, currentRegister, 0, 2 );
-        storeCode( STO, currentRegister, level - symbolTable[index].level, symbolTable[index].addr );
-        currentRegister--;
+        nextLexeme();
         
-        nextLexeme( currentNode );
+        if (symbolTable[index].kind == array) {
+            element = arrayElement(index, &base);
+            reg = newRegister();
+            storeCode( SIO2, reg, 0, 2 );
+            storeCode( STX, reg, base, element );
+        }
+        else {
+            reg = newRegister();
+            storeCode( SIO2, reg, 0, 2 );
+            storeCode( STO, reg, level - symbolTable[index].level, symbolTable[index].addr );
+        }
         
     }
     
     // writesym
     else if ( currentToken == writesym )
     {
-        nextLexeme( currentNode );
+        nextLexeme();
         
         if ( currentToken != identsym )
         {
             reportError(18);
         }
         
-        nextLexeme(currentNode);
+        nextLexeme();
         i = currentToken;
         index = findToken(i);
         
-        if ( symbolTable[index].kind != variable )
+        if ( symbolTable[index].kind != variable && symbolTable[index].kind != array )
         {
             reportError(11);
         }
         
-        currentRegister++;
-        storeCode( LOD, currentRegister, level - symbolTable[index].level, symbolTable[index].addr );
-        storeCode( SIO1, currentRegister, 0, 1 );
-        currentRegister--;
+        nextLexeme();
         
-        nextLexeme( currentNode );
+        if (symbolTable[index].kind == array) {
+            element = arrayElement(index, &base);
+            reg = newRegister();
+            storeCode( LDX, reg, base, element );
+        }
+        else {
+            reg = newRegister();
+            storeCode( LOD, reg, level - symbolTable[index].level, symbolTable[index].addr );
+        }
+        
+        storeCode( SIO1, reg, 0, 1 );
         
     }
     
     
 }
 
-//
-void condition(node* currentNode) {
+// Returns the register holding the truth value
+int condition() {
     
     int relOpCode;
+    int reg;
+    int reg2;
+    int result;
     
     if (currentToken == oddsym) {
         
-        nextLexeme(currentNode);
+        nextLexeme();
         
-        expression(currentNode);
+        reg2 = expression();
+        reg = newRegister();
         
-        storeCode(ODD, currentRegister, 0, 0);
+        storeCode(ODD, reg, reg2, 0);
     } else {
         
-        expression( currentNode );
+        reg = expression();
         
         relOpCode = relOp();
         if ( ! relOpCode ) {
             reportError(13);
         }
         
-        nextLexeme( currentNode );
+        nextLexeme();
         
-        expression( currentNode );
+        reg2 = expression();
         
-        storeCode( relOpCode, currentRegister-1, currentRegister-1, currentRegister );
-        
-        currentRegister--;
+        result = newRegister();
+        storeCode( relOpCode, result, reg, reg2 );
+        reg = result;
     }
+    
+    return reg;
 }
 
 //
@@ -677,124 +1253,152 @@ int relOp() {
     
 }
 
-//
-void expression(node* currentNode) {
+// Returns the register holding the value of the expression
+int expression() {
     
     int addOp;
+    int reg;
+    int reg2;
+    int result;
     
     if (currentToken == plussym || currentToken == minussym) {
         
         addOp = currentToken;
         
-        nextLexeme(currentNode);
-        checkCode (currentNode);
+        nextLexeme();
+        reg = checkCode ();
         
-        storeCode(NEG, currentRegister, currentRegister, 0);
+        if ( addOp == minussym ) {
+            result = newRegister();
+            storeCode(NEG, result, reg, 0);
+            reg = result;
+        }
     } else {
-        checkCode ( currentNode );
+        reg = checkCode ();
     }
     
     while ( currentToken == plussym || currentToken == minussym ) {
         
         addOp = currentToken;
         
-        nextLexeme( currentNode );
-        checkCode( currentNode );
+        nextLexeme();
+        reg2 = checkCode();
+        
+        result = newRegister();
         
         if ( addOp == plussym ) {
-            storeCode ( ADD, currentRegister-1, currentRegister-1, currentRegister );
-            currentRegister--;
+            storeCode ( ADD, result, reg, reg2 );
         }
         if ( addOp == minussym ) {
-            storeCode ( SUB, currentRegister-1, currentRegister-1, currentRegister );
-            currentRegister--;
+            storeCode ( SUB, result, reg, reg2 );
         }
+        
+        reg = result;
     }
     
+    return reg;
 }
 
-//
-void checkCode(node *currentNode) {
+// Returns the register holding the value of the term
+int checkCode() {
     
     int multiplicationOp;
+    int reg;
+    int reg2;
+    int result;
     
-    factor( currentNode );
+    reg = factor();
     
     while ( currentToken == slashsym || currentToken == multsym ) {
         
         multiplicationOp = currentToken;
         
-        nextLexeme( currentNode );
-        factor( currentNode );
+        nextLexeme();
+        reg2 = factor();
+        
+        result = newRegister();
         
         if ( multiplicationOp == multsym ) {
-            storeCode( MUL, currentRegister-1, currentRegister-1, currentRegister );
-            currentRegister--;
+            storeCode( MUL, result, reg, reg2 );
         }
         if ( multiplicationOp == slashsym ) {
-            storeCode( DIV, currentRegister-1, currentRegister-1, currentRegister );
-            currentRegister--;
+            storeCode( DIV, result, reg, reg2 );
         }
+        
+        reg = result;
     }
     
+    return reg;
 }
 
-//
-void factor(node* currentNode) {
+// Returns the register holding the value of the factor
+int factor() {
     
     int index;
     int i;
     int value;
+    int element;
+    int base;
+    int reg = 0;
     
     // identsym
     if ( currentToken == identsym ) {
         
-        nextLexeme( currentNode );
+        nextLexeme();
         i = currentToken;
         index = findToken(i);
         
-        currentRegister++;
+        nextLexeme();
         
-        if ( symbolTable[index].kind == variable ) {
-            storeCode( LOD, currentRegister, level - symbolTable[index].level, symbolTable[index].addr );
+        if ( symbolTable[index].kind == array ) {
+            element = arrayElement(index, &base);
+            reg = newRegister();
+            storeCode( LDX, reg, base, element );
         }
-        else if ( symbolTable[index].kind == constant ) {
-            storeCode( LIT, currentRegister, 0, symbolTable[index].val );
-        } else {
-            reportError(14);
+        else {
+            
+            reg = newRegister();
+            
+            if ( symbolTable[index].kind == variable ) {
+                storeCode( LOD, reg, level - symbolTable[index].level, symbolTable[index].addr );
+            }
+            else if ( symbolTable[index].kind == constant ) {
+                storeCode( LIT, reg, 0, symbolTable[index].val );
+            } else {
+                reportError(14);
+            }
         }
-        
-        nextLexeme( currentNode );
     }
     
     else if ( currentToken == numbersym ) {
         
-        nextLexeme( currentNode );
+        nextLexeme();
         i = currentToken;
         
         value = atoi( symbolList[i].name );
         
-        currentRegister++;
+        reg = newRegister();
         
-        storeCode( LIT, currentRegister, 0, value );
+        storeCode( LIT, reg, 0, value );
         
-        nextLexeme( currentNode );
+        nextLexeme();
     }
     
     else if ( currentToken == lparentsym ) {
         
-        nextLexeme( currentNode );
-        expression( currentNode );
+        nextLexeme();
+        reg = expression();
         
         if ( currentToken != rparentsym ) {
             reportError(15);
         }
         
-        nextLexeme( currentNode );
+        nextLexeme();
     } else {
         reportError(16);
     }
     
+    return reg;
 }
 
 
@@ -865,167 +1469,5405 @@ void reportError(int errorType) {
         case 24:
             printf("24. Call of a constant or variable is meaningless." );
             break;
+        case 25:
+            printf("25. Array size must be a positive number or constant.");
+            break;
+        case 26:
+            printf("26. Right bracket missing.");
+            break;
+        case 27:
+            printf("27. Array must be followed by an index.");
+            break;
+        case 28:
+            printf("28. For must be followed by a variable.");
+            break;
+        case 29:
+            printf("29. to expected.");
+            break;
             
         default:
             break;
             
     }
     
+    if (tokenLine > 0)
+        printf(" Line %d, column %d.", tokenLine, tokenColumn);
+    
     printf("\n");
     
     exit(1);
 }
 
 
-// Retrieve the lexeme list and store it, returns the head of the list
-node* getLexemeList() {
+// Start the Scanner with its token stream piped to the Parser
+void openScanner() {
     
-    int buffer;
+    lexer = popen(SCANNER_COMMAND, "r");
     
-    // Open lexemelist
-    FILE* lexemelistPointer = fopen("lexemelist.txt", "rb");
-    
-    if ( ! lexemelistPointer) {
-        printf("\nParser unable to open lexemelist.\n");
+    if ( ! lexer) {
+        printf("\nParser unable to start the Scanner.\n");
         exit(-1);
     }
+}
+
+
+// Read whatever the Scanner still has to say and wait for it, stopping here if it found an error
+void closeScanner() {
     
-    node* head = NULL;
-    node* tail = NULL;
-    
-    fscanf(lexemelistPointer, " %d", &buffer);
-    
-    head = tail = insertNode(head, tail, buffer);
+    if ( ! lexer)
+        return;
     
-    // Scan to EOF
-    while ( fscanf(lexemelistPointer, "%d", &buffer) != EOF) {
-        
-        tail = insertNode(head, tail, buffer);
-        tail->token = buffer;
-        
-    }
+    while (fgetc(lexer) != EOF);
     
+    int status = pclose(lexer);
+    lexer = NULL;
     
-    fclose(lexemelistPointer);
-    return head;
+    // The Scanner has already reported the error
+    if (status != 0)
+        exit(1);
 }
 
 
-// Retrieve the next lexeme in the linked list
-void nextLexeme(node* currentNode) {
+// Pull the next token from the Scanner, past the end the last token repeats
+// Identifier and number tokens bring their symbol table index, which becomes the following token,
+// and their text, which is entered into the symbol list at that index
+void nextLexeme() {
+    
+    int token;
+    char name[MAX_IDENT_LENGTH + 1];
+    int line;
+    int column;
+    
+    if (pendingIndex >= 0) {
+        currentToken = pendingIndex;
+        pendingIndex = -1;
+        return;
+    }
+    
+    if ( ! lexer)
+        return;
     
-    currentToken = currentNode->token;
+    if (fscanf(lexer, "%d %d %d", &token, &line, &column) != 3) {
+        closeScanner();
+        return;
+    }
+    
+    lastLine = tokenLine;
+    tokenLine = line;
+    tokenColumn = column;
     
-    if (currentNode->next != NULL) {
-        *currentNode = *currentNode->next;
+    if (token == identsym || token == numbersym) {
+        
+        if (fscanf(lexer, "%d %11s", &pendingIndex, name) != 2 || pendingIndex < 0 || pendingIndex >= MAX_SYMBOL_TABLE_SIZE) {
+            printf("\nParser received a malformed token stream.\n");
+            exit(-1);
+        }
+        
+        strcpy(symbolList[pendingIndex].name, name);
     }
     
+    currentToken = token;
 }
 
 
-// Create a new node
-node* newNode(int data) {
+// Print the code to output
+void storeCode(int op, int r, int l, int m) {
     
-    node* pointer = malloc(sizeof(node));
+    instruction in;
     
-    pointer->token = data;
-    pointer->next = NULL;
+    in.op = op;
+    in.r = r;
+    in.l = l;
+    in.m = m;
+    in.site = op == JPC ? ++siteCount : 0;
+    in.line = lastLine;
     
+    if (op == JPC)
+        siteUnit[siteCount] = currentUnit;
     
-    return pointer;
+    appendCode(&units[currentUnit], in);
 }
 
 
-// Linked list insert
-node* insertNode(node* head, node* tail, int token) {
+// Add an instruction to the end of a unit, growing its buffer as needed
+void appendCode(procedureUnit* unit, instruction in) {
     
-    // Start a list if needed
-    if (head == NULL) {
-        return newNode(token);
-    }
-    else {
-        tail->next = newNode(token);
-        return tail->next;
+    if (unit->length == unit->capacity) {
+        
+        unit->capacity = unit->capacity ? unit->capacity * 2 : 64;
+        unit->code = realloc(unit->code, unit->capacity * sizeof(instruction));
+        
+        if ( ! unit->code) {
+            printf("\nParser out of memory.\n");
+            exit(-1);
+        }
     }
     
+    unit->code[unit->length] = in;
+    unit->length++;
 }
 
 
-// Retrieve the symbol table and store it in an array, returns the length
-int getSymbolList(symbol* symList) {
+// Append a copy of the code in [start, end) of a unit, giving every register it defines a fresh one
+// Jumps within the range follow the copy. Returns what reg became in the copy
+int duplicateCode(procedureUnit* unit, int start, int end, int reg) {
     
-    char buffer[MAX_IDENT_LENGTH + 1];
-    int i = 0;
+    int offset = unit->length - start;
+    int* renamed = malloc((unit->registerCount + 1) * sizeof(int));
     
-    // Open symboltable file
-    FILE* symboltablePointer = fopen("symboltable.txt", "rb");
+    for (int v = 0; v < unit->registerCount; v++) {
+        renamed[v] = v;
+    }
     
-    if ( ! symboltablePointer) {
-        printf("\nParser unable to open symbol table file.\n");
-        exit(-1);
+    for (int i = start; i < end; i++) {
+        
+        instruction in = unit->code[i];
+        int fields = registerFields(in.op);
+        
+        if (fields & USES_R)
+            in.r = renamed[in.r];
+        if (fields & USES_L)
+            in.l = renamed[in.l];
+        if (fields & USES_M)
+            in.m = renamed[in.m];
+        
+        if (fields & DEFINES_R) {
+            renamed[in.r] = unit->registerCount;
+            in.r = unit->registerCount++;
+        }
+        
+        if (isJump(in.op) && in.m >= start && in.m < end)
+            in.m += offset;
+        
+        appendCode(unit, in);
     }
-    // Scan to EOF
-    while (fscanf(symboltablePointer, "%s", buffer) != EOF) {
-        strcpy(symList[i].name, buffer);
-        i++;
+    
+    reg = renamed[reg];
+    free(renamed);
+    
+    return reg;
+}
+
+
+// Start the unit for the block at the current level, returns its index
+int newUnit() {
+    
+    if (unitCount == MAX_PROCEDURES) {
+        printf("\nParser procedure limit exceeded.\n");
+        exit(-1);
     }
     
-    fclose(symboltablePointer);
+    units[unitCount].code = NULL;
+    units[unitCount].length = 0;
+    units[unitCount].capacity = 0;
+    units[unitCount].level = level;
+    units[unitCount].parent = -1;
+    units[unitCount].registerCount = 0;
+    units[unitCount].reachable = 0;
     
-    return i;
+    // Blocks open in order, so the last unit a level up is the one still open around this one
+    for (int i = unitCount - 1; i >= 0 && units[unitCount].parent < 0 && level > 0; i--) {
+        if (units[i].level == level - 1)
+            units[unitCount].parent = i;
+    }
     
+    return unitCount++;
 }
 
 
-// Print the code to output
-void storeCode(int op, int r, int l, int m) {
-    
-    code[codeLine].op = op;
-    code[codeLine].r = r;
-    code[codeLine].l = l;
-    code[codeLine].m = m;
+// A fresh virtual register in the unit being generated
+int newRegister() {
     
-    codeLine++;
+    return units[currentUnit].registerCount++;
 }
 
 
-// Prints code to the output file
-void outputCodeToFile() {
+// Total the instructions of every unit, before the stages that copy code
+void countProgram() {
     
-    FILE* output = fopen("temp.txt", "w");
-    FILE* mcodeOutput = fopen("mcode.txt", "w");
+    programLength = 0;
     
-    for (int i = 0; i < codeLine; i++) {
-        fprintf(output, "%d %d %d %d\n", code[i].op, code[i].r, code[i].l, code[i].m);
-        fprintf(mcodeOutput, "%d %d %d\n", code[i].op, code[i].l, code[i].m);
-
+    for (int i = 0; i < unitCount; i++) {
+        programLength += units[i].length;
     }
-    
-    fclose(output);
 }
 
 
-// Put symbol from Scanner into table
-void addtoSymbolTable(int symbolKind, int symListIndex) {
+// Claim room for instructions a rewrite adds, returns 0 and claims none when the program would
+// no longer fit the PMachine. Units are unrolled in parallel, so the total is shared under a lock
+int growProgram(int words) {
     
-    symbolTableIndex++;
+    int fits;
     
-    strcpy(symbolTable[symbolTableIndex].name, symbolList[symListIndex].name);
+    pthread_mutex_lock(&programLock);
     
-    symbolTable[symbolTableIndex].level = level;
-    symbolTable[symbolTableIndex].kind = symbolKind;
+    fits = programLength + words <= MAX_CODE_LENGTH;
+    
+    if (fits)
+        programLength += words;
+    
+    pthread_mutex_unlock(&programLock);
+    
+    return fits;
 }
 
 
-// Locate a token in the symbol table
-int findToken(int token) {
+// Lay the units out one after another into code, main block first so execution starts at 0
+// Jumps are relative to their unit and calls name a unit until now
+// With a profile the procedures follow in order of how often they were called, hottest first
+void linkUnits() {
     
-    int location;
+    int address[MAX_PROCEDURES];
+    int order[MAX_PROCEDURES];
     
-    for (location = symbolTableIndex; location > 0; location--)
-        if (strcmp(symbolTable[location].name, symbolList[token].name) == 0) {
-            return location;
+    for (int i = 0; i < unitCount; i++) {
+        
+        int j = i;
+        
+        while (profiled && j > 1 && unitCalls[order[j - 1]] < unitCalls[i]) {
+            order[j] = order[j - 1];
+            j--;
         }
+        
+        order[j] = i;
+    }
     
-    return location;
-}
\ No newline at end of file
+    codeLine = 0;
+    
+    // Procedures never called are left out
+    for (int k = 0; k < unitCount; k++) {
+        
+        int i = order[k];
+        
+        address[i] = codeLine;
+        
+        if (units[i].reachable)
+            codeLine += units[i].length;
+    }
+    
+    if (codeLine > MAX_CODE_LENGTH) {
+        printf("\nProgram too long for the PMachine, %d instructions of %d.\n", codeLine, MAX_CODE_LENGTH);
+        exit(-1);
+    }
+    
+    for (int i = 0; i < unitCount; i++) {
+        for (int j = 0; j < units[i].length && units[i].reachable; j++) {
+            
+            instruction in = units[i].code[j];
+            
+            if (isJump(in.op)) {
+                in.m += address[i];
+            }
+            else if (in.op == CAL || in.op == TCL || in.op == LCL || in.op == MCL || in.op == JAL) {
+                in.m = address[in.m];
+            }
+            
+            code[address[i] + j] = in;
+            codeUnit[address[i] + j] = i;
+        }
+    }
+}
+
+
+// Prints code to the output file
+void outputCodeToFile() {
+    
+    FILE* output = fopen("temp.txt", "w");
+    FILE* mcodeOutput = fopen("mcode.txt", "w");
+    
+    // Header for the PMachine: registers, stack words and activation records it needs, and the code length
+    fprintf(output, "%d %d %d %d\n", registerBound, stackBound, recordBound, codeLine);
+    
+    for (int i = 0; i < codeLine; i++) {
+        fprintf(output, "%d %d %d %d\n", code[i].op, code[i].r, code[i].l, code[i].m);
+        fprintf(mcodeOutput, "%d %d %d\n", code[i].op, code[i].l, code[i].m);
+
+    }
+    
+    // Then the key of each cache MCL looks in: its slots, each as how many static links up from the callee
+    // it is, its address, and whether the procedure may write it so a hit has to redo that
+    if (memoCount > 0)
+        fprintf(output, "%d\n", memoCount);
+    
+    for (int u = 0; u < unitCount; u++) {
+        
+        if ( ! memoTable[u])
+            continue;
+        
+        fprintf(output, "%d", memoKey(u, NULL));
+        
+        for (int s = 0; s < effectSlotCount; s++) {
+            
+            int written = testBit(unitWrites[u], s);
+            
+            if (written || testBit(unitReads[u], s))
+                fprintf(output, " %d %d %d", units[u].level - effectSlots[s].l, effectSlots[s].m, written);
+        }
+        
+        fprintf(output, "\n");
+    }
+    
+    fclose(output);
+    
+    // Which unit each line belongs to and the site of each conditional jump, for readProfile()
+    if (writeLayout) {
+        
+        FILE* layout = fopen("layout.txt", "w");
+        
+        for (int i = 0; i < codeLine; i++) {
+            
+            int op = code[i].op;
+            int site = op == JPC || op == JPT || (op >= BEQ && op <= BGE) || op == LOP ? code[i].site : 0;
+            
+            fprintf(layout, "%d %d\n", codeUnit[i], site);
+        }
+        
+        fclose(layout);
+    }
+}
+
+
+// Where each procedure starts and the first instruction of each run parsed from the same source line, for
+// the PMachine's source listing. Code the optimizer made up counts toward the line before it
+void outputLineTable() {
+    
+    int* line = malloc((codeLine + 1) * sizeof(int));
+    int procedures = 0;
+    int runs = 0;
+    
+    for (int i = 0; i < codeLine; i++) {
+        
+        int start = i == 0 || codeUnit[i] != codeUnit[i - 1];
+        
+        line[i] = code[i].line > 0 || start ? code[i].line : line[i - 1];
+        procedures += start;
+        runs += start || line[i] != line[i - 1];
+    }
+    
+    FILE* table = fopen("lines.txt", "w");
+    
+    fprintf(table, "%d %d\n", procedures, runs);
+    
+    for (int i = 0; i < codeLine; i++) {
+        if (i == 0 || codeUnit[i] != codeUnit[i - 1])
+            fprintf(table, "%d %s\n", i, codeUnit[i] ? unitName[codeUnit[i]] : "main");
+    }
+    
+    for (int i = 0; i < codeLine; i++) {
+        if (i == 0 || codeUnit[i] != codeUnit[i - 1] || line[i] != line[i - 1])
+            fprintf(table, "%d %d\n", i, line[i]);
+    }
+    
+    fclose(table);
+    free(line);
+}
+
+
+// Put symbol from Scanner into table
+void addtoSymbolTable(int symbolKind, int symListIndex) {
+    
+    symbolTableIndex++;
+    
+    strcpy(symbolTable[symbolTableIndex].name, symbolList[symListIndex].name);
+    
+    symbolTable[symbolTableIndex].level = level;
+    symbolTable[symbolTableIndex].kind = symbolKind;
+}
+
+
+// Locate a token in the symbol table
+int findToken(int token) {
+    
+    int location;
+    
+    for (location = symbolTableIndex; location > 0; location--)
+        if (strcmp(symbolTable[location].name, symbolList[token].name) == 0) {
+            return location;
+        }
+    
+    return location;
+}
+
+
+// Run the intraprocedural clean up passes until none of them finds anything more to do
+void optimizeUnit(procedureUnit* unit) {
+    
+    int changed = 1;
+    
+    while (changed) {
+        
+        changed = propagateSlots(unit);
+        changed |= foldConstants(unit);
+        changed |= numberValues(unit);
+        changed |= hoistLoopInvariants(unit);
+        changed |= reduceStrength(unit);
+        changed |= removeUnreachableCode(unit);
+        changed |= eliminateDeadStores(unit);
+        changed |= eliminateDeadCode(unit);
+    }
+}
+
+
+// Evaluate operations on constant registers, branches on constant conditions become jumps or vanish
+// Registers are only ever written once at this point, so a constant register is constant everywhere
+int foldConstants(procedureUnit* unit) {
+    
+    int n = unit->registerCount;
+    int changed = 0;
+    int result;
+    
+    char* known = calloc(n + 1, 1);
+    int* value = calloc(n + 1, sizeof(int));
+    int* replacement = malloc((n + 1) * sizeof(int));
+    char* removed = calloc(unit->length + 1, 1);
+    
+    for (int v = 0; v < n; v++) {
+        replacement[v] = v;
+    }
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction* in = &unit->code[i];
+        int fields = registerFields(in->op);
+        
+        if (fields & USES_R)
+            in->r = replacement[in->r];
+        if (fields & USES_L)
+            in->l = replacement[in->l];
+        if (fields & USES_M)
+            in->m = replacement[in->m];
+        
+        switch (in->op) {
+                
+            case LIT:
+                known[in->r] = 1;
+                value[in->r] = in->m;
+                break;
+                
+            // M is an immediate for the shifts, masks and multiply-high
+            case NEG:
+            case ODD:
+            case SHL:
+            case SHR:
+            case AND:
+            case MLH:
+                if (known[in->l] && evaluateOperation(in->op, value[in->l], in->m, &result)) {
+                    in->op = LIT;
+                    in->l = 0;
+                    in->m = result;
+                    known[in->r] = 1;
+                    value[in->r] = result;
+                    changed = 1;
+                }
+                break;
+                
+            case JPC:
+            case JPT:
+                if (known[in->r]) {
+                    
+                    // Never taken, or always
+                    if ((value[in->r] != 0) == (in->op == JPC))
+                        removed[i] = 1;
+                    else
+                        in->op = JMP;
+                    
+                    in->r = 0;
+                    changed = 1;
+                }
+                break;
+                
+            default:
+                
+                if ((fields & (USES_L | USES_M)) != (USES_L | USES_M))
+                    break;
+                
+                if (known[in->l] && known[in->m] && evaluateOperation(in->op, value[in->l], value[in->m], &result)) {
+                    in->op = LIT;
+                    in->l = 0;
+                    in->m = result;
+                    known[in->r] = 1;
+                    value[in->r] = result;
+                    changed = 1;
+                }
+                
+                // Operations that leave an operand unchanged
+                else if ((in->op == ADD || in->op == SUB || in->op == MUL || in->op == DIV)
+                         && known[in->m] && value[in->m] == (in->op == ADD || in->op == SUB ? 0 : 1)) {
+                    replacement[in->r] = in->l;
+                    removed[i] = 1;
+                    changed = 1;
+                }
+                else if ((in->op == ADD || in->op == MUL)
+                         && known[in->l] && value[in->l] == (in->op == ADD ? 0 : 1)) {
+                    replacement[in->r] = in->m;
+                    removed[i] = 1;
+                    changed = 1;
+                }
+                else if (in->op == MUL && ((known[in->l] && value[in->l] == 0) || (known[in->m] && value[in->m] == 0))) {
+                    in->op = LIT;
+                    in->l = 0;
+                    in->m = 0;
+                    known[in->r] = 1;
+                    value[in->r] = 0;
+                    changed = 1;
+                }
+                break;
+        }
+    }
+    
+    // Uses placed before the definition they were renamed to
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction* in = &unit->code[i];
+        int fields = registerFields(in->op);
+        
+        if (fields & USES_R)
+            in->r = replacement[in->r];
+        if (fields & USES_L)
+            in->l = replacement[in->l];
+        if (fields & USES_M)
+            in->m = replacement[in->m];
+    }
+    
+    if (changed)
+        compactCode(unit, removed);
+    
+    free(known);
+    free(value);
+    free(replacement);
+    free(removed);
+    
+    return changed;
+}
+
+
+// Forward dataflow over the frame slots of a unit, tracking slots known to hold a constant or the
+// value of a register. Loads of those slots become LITs or reuse the register, leaving the rest to
+// foldConstants() and eliminateDeadStores(). Calls clobber the slots they can reach, and a read
+// only ever stores a register, so it is never taken for a constant
+int propagateSlots(procedureUnit* unit) {
+    
+    int n = unit->registerCount;
+    int changed = 1;
+    int rewritten = 0;
+    
+    basicBlock* blocks = malloc((unit->length + 1) * sizeof(basicBlock));
+    int* blockOf = malloc((unit->length + 1) * sizeof(int));
+    int blockCount = findBasicBlocks(unit, blocks, blockOf);
+    int* order = malloc((blockCount + 1) * sizeof(int));
+    int orderCount = reversePostorder(blocks, blockCount, order);
+    
+    frameSlot* slots;
+    int slotCount = collectSlots(unit, &slots);
+    slotValue* out = malloc(((long)blockCount * slotCount + 1) * sizeof(slotValue));
+    slotValue* state = malloc((slotCount + 1) * sizeof(slotValue));
+    
+    char* isConstant = calloc(n + 1, 1);
+    int* constant = calloc(n + 1, sizeof(int));
+    int* replacement = malloc((n + 1) * sizeof(int));
+    char* removed = calloc(unit->length + 1, 1);
+    
+    for (int i = 0; i < unit->length; i++) {
+        if (unit->code[i].op == LIT) {
+            isConstant[unit->code[i].r] = 1;
+            constant[unit->code[i].r] = unit->code[i].m;
+        }
+    }
+    
+    for (int v = 0; v < n; v++) {
+        replacement[v] = v;
+    }
+    
+    for (long s = 0; s < (long)blockCount * slotCount; s++) {
+        out[s].kind = SLOT_UNKNOWN;
+    }
+    
+    while (changed) {
+        
+        changed = 0;
+        
+        for (int k = 0; k < orderCount; k++) {
+            
+            int b = order[k];
+            
+            slotsIn(blocks, order, orderCount, b, out, slotCount, state);
+            transferSlots(unit, &blocks[b], state, slots, slotCount, isConstant, constant, NULL, NULL);
+            
+            if (memcmp(state, &out[(long)b * slotCount], slotCount * sizeof(slotValue)) != 0) {
+                memcpy(&out[(long)b * slotCount], state, slotCount * sizeof(slotValue));
+                changed = 1;
+            }
+        }
+    }
+    
+    for (int k = 0; k < orderCount; k++) {
+        
+        int b = order[k];
+        
+        slotsIn(blocks, order, orderCount, b, out, slotCount, state);
+        rewritten |= transferSlots(unit, &blocks[b], state, slots, slotCount, isConstant, constant, replacement, removed);
+    }
+    
+    // Uses placed before the load they were renamed from, following chains of renamed loads
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction* in = &unit->code[i];
+        int fields = registerFields(in->op);
+        
+        if (fields & USES_R)
+            while (replacement[in->r] != in->r) in->r = replacement[in->r];
+        if (fields & USES_L)
+            while (replacement[in->l] != in->l) in->l = replacement[in->l];
+        if (fields & USES_M)
+            while (replacement[in->m] != in->m) in->m = replacement[in->m];
+    }
+    
+    if (rewritten)
+        compactCode(unit, removed);
+    
+    free(blocks);
+    free(blockOf);
+    free(order);
+    free(slots);
+    free(out);
+    free(state);
+    free(isConstant);
+    free(constant);
+    free(replacement);
+    free(removed);
+    
+    return rewritten;
+}
+
+
+// Meet of the slot states leaving the predecessors of a block, nothing is known on entry to the unit
+void slotsIn(basicBlock* blocks, int* order, int orderCount, int b, slotValue* out, int slotCount, slotValue* state) {
+    
+    slotValue varying = { SLOT_VARYING, 0 };
+    
+    for (int s = 0; s < slotCount; s++) {
+        state[s].kind = b == 0 ? SLOT_VARYING : SLOT_UNKNOWN;
+        state[s].value = 0;
+    }
+    
+    for (int j = 0; j < orderCount; j++) {
+        
+        basicBlock* p = &blocks[order[j]];
+        
+        if ( ! ((p->successorCount > 0 && p->successors[0] == b) || (p->successorCount > 1 && p->successors[1] == b)))
+            continue;
+        
+        for (int s = 0; s < slotCount; s++) {
+            
+            slotValue incoming = out[(long)order[j] * slotCount + s];
+            
+            if (incoming.kind == SLOT_UNKNOWN || state[s].kind == SLOT_VARYING)
+                continue;
+            
+            if (state[s].kind == SLOT_UNKNOWN)
+                state[s] = incoming;
+            else if (state[s].kind != incoming.kind || state[s].value != incoming.value)
+                state[s] = varying;
+        }
+    }
+}
+
+
+// Carry the slot states through a block. With replacement given, loads of known slots are rewritten
+// as well, returns whether any was
+int transferSlots(procedureUnit* unit, basicBlock* block, slotValue* state, frameSlot* slots, int slotCount,
+                  char* isConstant, int* constant, int* replacement, char* removed) {
+    
+    int rewritten = 0;
+    slotValue varying = { SLOT_VARYING, 0 };
+    
+    for (int i = block->start; i < block->end; i++) {
+        
+        instruction* in = &unit->code[i];
+        int fields = registerFields(in->op);
+        int slot;
+        
+        if (replacement) {
+            if (fields & USES_R)
+                while (replacement[in->r] != in->r) in->r = replacement[in->r];
+            if (fields & USES_L)
+                while (replacement[in->l] != in->l) in->l = replacement[in->l];
+            if (fields & USES_M)
+                while (replacement[in->m] != in->m) in->m = replacement[in->m];
+        }
+        
+        slot = in->op == LOD ? slotIndex(slots, slotCount, in->l, in->m) : -1;
+        
+        if (replacement && slot >= 0 && state[slot].kind == SLOT_COPY) {
+            replacement[in->r] = state[slot].value;
+            removed[i] = 1;
+            rewritten = 1;
+            continue;
+        }
+        
+        // A register written again, as happens going round a loop, no longer matches the slots copied from it
+        if (fields & DEFINES_R) {
+            for (int s = 0; s < slotCount; s++) {
+                if (state[s].kind == SLOT_COPY && state[s].value == in->r)
+                    state[s] = varying;
+            }
+        }
+        
+        if (slot >= 0 && state[slot].kind == SLOT_CONSTANT) {
+            
+            if (replacement) {
+                in->op = LIT;
+                in->l = 0;
+                in->m = state[slot].value;
+                isConstant[in->r] = 1;
+                constant[in->r] = in->m;
+                rewritten = 1;
+            }
+        }
+        else if (slot >= 0 && state[slot].kind != SLOT_COPY) {
+            state[slot].kind = SLOT_COPY;
+            state[slot].value = in->r;
+        }
+        
+        if (in->op == STO) {
+            
+            slot = slotIndex(slots, slotCount, in->l, in->m);
+            
+            if (isConstant[in->r]) {
+                state[slot].kind = SLOT_CONSTANT;
+                state[slot].value = constant[in->r];
+            }
+            else {
+                state[slot].kind = SLOT_COPY;
+                state[slot].value = in->r;
+            }
+        }
+        
+        // A call changes the slots the callee or what it calls may store to
+        else if (in->op == CAL) {
+            for (int s = 0; s < slotCount; s++) {
+                if (callTouches(unit, *in, slots[s].l, slots[s].m, 1))
+                    state[s] = varying;
+            }
+        }
+    }
+    
+    return rewritten;
+}
+
+
+// Value numbering over the dominator tree, repeated loads and operations reuse the register that
+// already holds their value. An operation stays available wherever its definition dominates, since
+// registers are written once, while a remembered load only flows into blocks with one predecessor
+// and is forgotten when its slot is stored to or a call could change it
+int numberValues(procedureUnit* unit) {
+    
+    int n = unit->registerCount;
+    int changed = 0;
+    int expressionCount = 0;
+    int constantCount = 0;
+    
+    basicBlock* blocks = malloc((unit->length + 1) * sizeof(basicBlock));
+    int* blockOf = malloc((unit->length + 1) * sizeof(int));
+    int blockCount = findBasicBlocks(unit, blocks, blockOf);
+    
+    int* order = malloc((blockCount + 1) * sizeof(int));
+    int orderCount = reversePostorder(blocks, blockCount, order);
+    bitset* dominators = malloc((blockCount + 1) * sizeof(bitset));
+    computeDominators(blocks, blockCount, order, orderCount, dominators);
+    
+    frameSlot* slots;
+    int slotCount = collectSlots(unit, &slots);
+    int* memory = malloc(((long)blockCount * slotCount + 1) * sizeof(int));
+    int* predecessorCount = calloc(blockCount + 1, sizeof(int));
+    int* predecessor = malloc((blockCount + 1) * sizeof(int));
+    char* done = calloc(blockCount + 1, 1);
+    
+    int* number = malloc((n + 1) * sizeof(int));
+    int* replacement = malloc((n + 1) * sizeof(int));
+    int* constants = malloc((unit->length + 1) * sizeof(int));
+    int* constantRegister = malloc((unit->length + 1) * sizeof(int));
+    int* constantBlock = malloc((unit->length + 1) * sizeof(int));
+    valueExpression* expressions = malloc((unit->length + 1) * sizeof(valueExpression));
+    char* removed = calloc(unit->length + 1, 1);
+    
+    for (int v = 0; v < n; v++) {
+        number[v] = v;
+        replacement[v] = v;
+    }
+    
+    for (int k = 0; k < orderCount; k++) {
+        for (int s = 0; s < blocks[order[k]].successorCount; s++) {
+            
+            int successor = blocks[order[k]].successors[s];
+            
+            predecessorCount[successor]++;
+            predecessor[successor] = order[k];
+        }
+    }
+    
+    for (int k = 0; k < orderCount; k++) {
+        
+        int b = order[k];
+        int* current = &memory[(long)b * slotCount];
+        
+        if (predecessorCount[b] == 1 && done[predecessor[b]])
+            memcpy(current, &memory[(long)predecessor[b] * slotCount], slotCount * sizeof(int));
+        else
+            for (int s = 0; s < slotCount; s++) current[s] = -1;
+        
+        for (int i = blocks[b].start; i < blocks[b].end; i++) {
+            
+            instruction* in = &unit->code[i];
+            int fields = registerFields(in->op);
+            int slot;
+            
+            if (fields & USES_R)
+                in->r = replacement[in->r];
+            if (fields & USES_L)
+                in->l = replacement[in->l];
+            if (fields & USES_M)
+                in->m = replacement[in->m];
+            
+            switch (in->op) {
+                    
+                // Equal constants share a number, but only reuse a register within a block
+                // since a LIT is as cheap as keeping the value live any further
+                case LIT: {
+                    
+                    int c = 0;
+                    
+                    while (c < constantCount && constants[c] != in->m) c++;
+                    
+                    if (c == constantCount) {
+                        constants[constantCount++] = in->m;
+                        constantBlock[c] = -1;
+                    }
+                    
+                    if (constantBlock[c] == b) {
+                        replacement[in->r] = constantRegister[c];
+                        removed[i] = 1;
+                        changed = 1;
+                    }
+                    else {
+                        constantBlock[c] = b;
+                        constantRegister[c] = in->r;
+                    }
+                    
+                    number[in->r] = n + c;
+                    break;
+                }
+                    
+                case LOD:
+                    slot = slotIndex(slots, slotCount, in->l, in->m);
+                    
+                    if (current[slot] >= 0) {
+                        replacement[in->r] = current[slot];
+                        number[in->r] = number[current[slot]];
+                        removed[i] = 1;
+                        changed = 1;
+                    }
+                    else {
+                        current[slot] = in->r;
+                    }
+                    break;
+                    
+                case STO:
+                    current[slotIndex(slots, slotCount, in->l, in->m)] = in->r;
+                    break;
+                    
+                // A call changes the slots the callee or what it calls may store to
+                case CAL:
+                    for (int s = 0; s < slotCount; s++) {
+                        if (callTouches(unit, *in, slots[s].l, slots[s].m, 1))
+                            current[s] = -1;
+                    }
+                    break;
+                    
+                // What an element holds is no value, a store through another index may change it
+                case LDX:
+                case SUM:
+                    break;
+                    
+                // An index a dominating check already passed needs no second one
+                case CHK: {
+                    
+                    int e;
+                    
+                    for (e = 0; e < expressionCount; e++) {
+                        if (expressions[e].op == CHK && expressions[e].a == number[in->r] && expressions[e].b == in->m
+                            && testBit(dominators[b], expressions[e].block))
+                            break;
+                    }
+                    
+                    if (e < expressionCount) {
+                        removed[i] = 1;
+                        changed = 1;
+                    }
+                    else {
+                        expressions[expressionCount].op = CHK;
+                        expressions[expressionCount].a = number[in->r];
+                        expressions[expressionCount].b = in->m;
+                        expressions[expressionCount].reg = -1;
+                        expressions[expressionCount].block = b;
+                        expressionCount++;
+                    }
+                    break;
+                }
+                    
+                default: {
+                    
+                    if ( ! (fields & DEFINES_R) || ( ! (fields & USES_L) && in->op != ADR))
+                        break;
+                    
+                    // An ADR is numbered by the frame word it addresses
+                    int a = in->op == ADR ? in->l : number[in->l];
+                    int c = fields & USES_M ? number[in->m] : in->m;
+                    int e;
+                    
+                    if ((in->op == ADD || in->op == MUL || in->op == EQL || in->op == NEQ) && c < a) {
+                        int t = a;
+                        a = c;
+                        c = t;
+                    }
+                    
+                    for (e = 0; e < expressionCount; e++) {
+                        if (expressions[e].op == in->op && expressions[e].a == a && expressions[e].b == c
+                            && testBit(dominators[b], expressions[e].block))
+                            break;
+                    }
+                    
+                    if (e < expressionCount) {
+                        replacement[in->r] = expressions[e].reg;
+                        number[in->r] = number[expressions[e].reg];
+                        removed[i] = 1;
+                        changed = 1;
+                    }
+                    else {
+                        expressions[expressionCount].op = in->op;
+                        expressions[expressionCount].a = a;
+                        expressions[expressionCount].b = c;
+                        expressions[expressionCount].reg = in->r;
+                        expressions[expressionCount].block = b;
+                        expressionCount++;
+                    }
+                    break;
+                }
+            }
+        }
+        
+        done[b] = 1;
+    }
+    
+    // Uses in blocks visited before the definition they were renamed to
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction* in = &unit->code[i];
+        int fields = registerFields(in->op);
+        
+        if (fields & USES_R)
+            in->r = replacement[in->r];
+        if (fields & USES_L)
+            in->l = replacement[in->l];
+        if (fields & USES_M)
+            in->m = replacement[in->m];
+    }
+    
+    if (changed)
+        compactCode(unit, removed);
+    
+    for (int b = 0; b < blockCount; b++) {
+        free(dominators[b]);
+    }
+    
+    free(blocks);
+    free(blockOf);
+    free(order);
+    free(dominators);
+    free(slots);
+    free(memory);
+    free(predecessorCount);
+    free(predecessor);
+    free(done);
+    free(number);
+    free(replacement);
+    free(constants);
+    free(constantRegister);
+    free(constantBlock);
+    free(expressions);
+    free(removed);
+    
+    return changed;
+}
+
+
+// Order the blocks reachable from the entry so each comes before its successors, back edges aside
+// Returns how many were reached
+int reversePostorder(basicBlock* blocks, int blockCount, int* order) {
+    
+    int count = blockCount;
+    int top = 0;
+    int* stack = malloc((blockCount + 1) * sizeof(int));
+    int* next = calloc(blockCount + 1, sizeof(int));
+    char* visited = calloc(blockCount + 1, 1);
+    
+    stack[top++] = 0;
+    visited[0] = 1;
+    
+    while (top > 0) {
+        
+        int b = stack[top - 1];
+        
+        if (next[b] < blocks[b].successorCount) {
+            
+            int successor = blocks[b].successors[next[b]++];
+            
+            if ( ! visited[successor]) {
+                visited[successor] = 1;
+                stack[top++] = successor;
+            }
+        }
+        else {
+            order[--count] = b;
+            top--;
+        }
+    }
+    
+    // Shift the reached blocks to the front
+    int reached = blockCount - count;
+    memmove(order, order + count, reached * sizeof(int));
+    
+    free(stack);
+    free(next);
+    free(visited);
+    
+    return reached;
+}
+
+
+// Set of blocks dominating each block, as a bitset over block numbers. Unreached blocks get every block
+void computeDominators(basicBlock* blocks, int blockCount, int* order, int orderCount, bitset* dominators) {
+    
+    int words = bitsetWords(blockCount);
+    int changed = 1;
+    bitset meet = newBitset(blockCount);
+    
+    for (int b = 0; b < blockCount; b++) {
+        
+        dominators[b] = newBitset(blockCount);
+        
+        for (int w = 0; w < words; w++) {
+            dominators[b][w] = b == 0 ? 0 : ~0u;
+        }
+    }
+    
+    setBit(dominators[0], 0);
+    
+    while (changed) {
+        
+        changed = 0;
+        
+        for (int k = 1; k < orderCount; k++) {
+            
+            int b = order[k];
+            
+            for (int w = 0; w < words; w++) {
+                meet[w] = ~0u;
+            }
+            
+            for (int j = 0; j < orderCount; j++) {
+                
+                basicBlock* p = &blocks[order[j]];
+                
+                if ((p->successorCount > 0 && p->successors[0] == b) || (p->successorCount > 1 && p->successors[1] == b))
+                    for (int w = 0; w < words; w++) meet[w] &= dominators[order[j]][w];
+            }
+            
+            setBit(meet, b);
+            
+            for (int w = 0; w < words; w++) {
+                
+                if (meet[w] != dominators[b][w]) {
+                    dominators[b][w] = meet[w];
+                    changed = 1;
+                }
+            }
+        }
+    }
+    
+    free(meet);
+}
+
+
+// Compute an arithmetic or relational op code the way the PM/0 CPU would
+// Returns 0 when the result would fault at run time and must be left to the machine
+int evaluateOperation(int op, int a, int b, int* value) {
+    
+    switch (op) {
+            
+        case NEG:
+            *value = (int)(0u - (unsigned int)a);
+            return 1;
+        case ODD:
+            *value = a % 2;
+            return 1;
+        case ADD:
+            *value = (int)((unsigned int)a + (unsigned int)b);
+            return 1;
+        case SUB:
+            *value = (int)((unsigned int)a - (unsigned int)b);
+            return 1;
+        case MUL:
+            *value = (int)((unsigned int)a * (unsigned int)b);
+            return 1;
+        case DIV:
+        case MOD:
+            if (b == 0 || (a == -2147483647 - 1 && b == -1))
+                return 0;
+            *value = op == DIV ? a / b : a % b;
+            return 1;
+        case EQL:
+            *value = a == b;
+            return 1;
+        case NEQ:
+            *value = a != b;
+            return 1;
+        case LSS:
+            *value = a < b;
+            return 1;
+        case LEQ:
+            *value = a <= b;
+            return 1;
+        case GTR:
+            *value = a > b;
+            return 1;
+        case GEQ:
+            *value = a >= b;
+            return 1;
+        case SHL:
+            *value = (int)((unsigned int)a << (b & 31));
+            return 1;
+        case SHR:
+            *value = a >> (b & 31);
+            return 1;
+        case AND:
+            *value = a & b;
+            return 1;
+        case MLH:
+            *value = (int)(((long long)a * b) >> 32);
+            return 1;
+            
+        default:
+            return 0;
+    }
+}
+
+
+// Rewrite multiplication, division and modulo by constants into shifts, masks and multiply-high
+// Division truncates toward zero like DIV, so a dividend not known to be non-negative gets
+// the usual correction. ODD only ever feeds a branch, where the low bit is as good as the remainder
+int reduceStrength(procedureUnit* unit) {
+    
+    int n = unit->registerCount;
+    int changed = 0;
+    
+    char* known = calloc(n + 1, 1);
+    int* value = calloc(n + 1, sizeof(int));
+    char* nonNegative = calloc(n + 1, 1);
+    int* newIndex = malloc((unit->length + 1) * sizeof(int));
+    
+    procedureUnit rewritten = *unit;
+    rewritten.code = NULL;
+    rewritten.length = 0;
+    rewritten.capacity = 0;
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction in = unit->code[i];
+        
+        if (in.op == LIT) {
+            known[in.r] = 1;
+            value[in.r] = in.m;
+            nonNegative[in.r] = in.m >= 0;
+        }
+        else if ((in.op >= EQL && in.op <= GEQ) || (in.op == AND && in.m >= 0)
+                 || (in.op == SHR && nonNegative[in.l])) {
+            nonNegative[in.r] = 1;
+        }
+    }
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction in = unit->code[i];
+        unsigned int constant = 0;
+        int operand = -1;
+        
+        newIndex[i] = rewritten.length;
+        
+        if (in.op == MUL && known[in.m]) {
+            constant = value[in.m];
+            operand = in.l;
+        }
+        else if (in.op == MUL && known[in.l]) {
+            constant = value[in.l];
+            operand = in.m;
+        }
+        
+        if (operand >= 0 && constant > 1 && (constant & (constant - 1)) == 0) {
+            emitOperation(&rewritten, SHL, operand, __builtin_ctz(constant));
+        }
+        else if (operand >= 0 && (int)constant < -1 && ((0u - constant) & (0u - constant - 1)) == 0) {
+            emitOperation(&rewritten, NEG, emitOperation(&rewritten, SHL, operand, __builtin_ctz(0u - constant)), 0);
+        }
+        else if ((in.op == DIV || in.op == MOD) && known[in.m]
+                 && value[in.m] != 0 && value[in.m] != 1 && value[in.m] != -1 && value[in.m] != -2147483647 - 1) {
+            
+            int divisor = value[in.m];
+            int magnitude = divisor < 0 ? -divisor : divisor;
+            
+            if (in.op == DIV) {
+                divideByConstant(&rewritten, in.l, divisor, nonNegative[in.l]);
+            }
+            else if ((magnitude & (magnitude - 1)) == 0 && nonNegative[in.l]) {
+                emitOperation(&rewritten, AND, in.l, magnitude - 1);
+            }
+            else if ((magnitude & (magnitude - 1)) == 0) {
+                
+                // a % 2^k == a - ((a + bias) & -2^k), the sign of the divisor does not matter
+                int bias = emitOperation(&rewritten, SHR, in.l, 31);
+                bias = emitOperation(&rewritten, AND, bias, magnitude - 1);
+                int rounded = emitOperation(&rewritten, ADD, in.l, bias);
+                rounded = emitOperation(&rewritten, AND, rounded, -magnitude);
+                emitOperation(&rewritten, SUB, in.l, rounded);
+            }
+            else {
+                int quotient = divideByConstant(&rewritten, in.l, divisor, nonNegative[in.l]);
+                emitOperation(&rewritten, SUB, in.l, emitOperation(&rewritten, MUL, quotient, in.m));
+            }
+        }
+        else if (in.op == ODD) {
+            emitOperation(&rewritten, AND, in.l, 1);
+        }
+        else {
+            appendCode(&rewritten, in);
+            continue;
+        }
+        
+        // The last instruction of the sequence produces the result
+        rewritten.code[rewritten.length - 1].r = in.r;
+        changed = 1;
+    }
+    
+    newIndex[unit->length] = rewritten.length;
+    relocateJumps(&rewritten, newIndex);
+    
+    free(unit->code);
+    *unit = rewritten;
+    
+    free(known);
+    free(value);
+    free(nonNegative);
+    free(newIndex);
+    
+    return changed;
+}
+
+
+// Emit the quotient of a register by a constant other than 0, 1, -1 and the most negative int
+// Returns the register holding it
+int divideByConstant(procedureUnit* unit, int dividend, int divisor, int nonNegative) {
+    
+    int magnitude = divisor < 0 ? -divisor : divisor;
+    int quotient;
+    int multiplier;
+    int shift;
+    
+    if ((magnitude & (magnitude - 1)) == 0) {
+        
+        int k = __builtin_ctz(magnitude);
+        
+        if (nonNegative) {
+            quotient = emitOperation(unit, SHR, dividend, k);
+        }
+        else {
+            // Adding 2^k - 1 to a negative dividend makes the shift round toward zero
+            int bias = emitOperation(unit, SHR, dividend, 31);
+            bias = emitOperation(unit, AND, bias, magnitude - 1);
+            quotient = emitOperation(unit, SHR, emitOperation(unit, ADD, dividend, bias), k);
+        }
+    }
+    else {
+        
+        divisionMagic(magnitude, &multiplier, &shift);
+        
+        quotient = emitOperation(unit, MLH, dividend, multiplier);
+        
+        if (multiplier < 0)
+            quotient = emitOperation(unit, ADD, quotient, dividend);
+        
+        if (shift > 0)
+            quotient = emitOperation(unit, SHR, quotient, shift);
+        
+        // One more for a negative dividend, dividend >> 31 is -1 exactly then
+        if ( ! nonNegative)
+            quotient = emitOperation(unit, SUB, quotient, emitOperation(unit, SHR, dividend, 31));
+    }
+    
+    if (divisor < 0)
+        quotient = emitOperation(unit, NEG, quotient, 0);
+    
+    return quotient;
+}
+
+
+// Magic multiplier and shift for signed division by a constant of at least 2
+// (Warren, Hacker's Delight, 10-1)
+void divisionMagic(int divisor, int* multiplier, int* shift) {
+    
+    const unsigned int two31 = 0x80000000u;
+    unsigned int magnitude = divisor;
+    unsigned int anc = two31 - 1 - two31 % magnitude;
+    unsigned int q1 = two31 / anc;
+    unsigned int r1 = two31 - q1 * anc;
+    unsigned int q2 = two31 / magnitude;
+    unsigned int r2 = two31 - q2 * magnitude;
+    unsigned int delta;
+    int p = 31;
+    
+    do {
+        p++;
+        
+        q1 = 2 * q1;
+        r1 = 2 * r1;
+        
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        
+        q2 = 2 * q2;
+        r2 = 2 * r2;
+        
+        if (r2 >= magnitude) {
+            q2++;
+            r2 -= magnitude;
+        }
+        
+        delta = magnitude - r2;
+        
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    
+    *multiplier = (int)(q2 + 1);
+    *shift = p - 32;
+}
+
+
+// Append op into a fresh register of the unit, returns the register
+int emitOperation(procedureUnit* unit, int op, int l, int m) {
+    
+    instruction in;
+    
+    in.op = op;
+    in.r = unit->registerCount++;
+    in.l = l;
+    in.m = m;
+    in.site = 0;
+    in.line = 0;
+    
+    appendCode(unit, in);
+    
+    return in.r;
+}
+
+
+// Loop invariant code motion, returns whether anything moved
+// Loops are recognized by their backward jump, which is how statement() lays out an inverted while
+int hoistLoopInvariants(procedureUnit* unit) {
+    
+    for (int j = 0; j < unit->length; j++) {
+        
+        instruction in = unit->code[j];
+        
+        if (isJump(in.op) && in.m <= j && hoistLoop(unit, in.m, j))
+            return 1;
+    }
+    
+    return 0;
+}
+
+
+// Move the invariant loads and operations of the loop [head, tail] into a preheader in front of it
+// which the back edge skips. The loop must be entered only by falling into head. A load is invariant
+// when the loop never stores to its slot, counting calls as stores to every slot they may change.
+// Divisions stay put since they could fault on an iteration that never happens
+int hoistLoop(procedureUnit* unit, int head, int tail) {
+    
+    int n = unit->registerCount;
+    int storedCount = 0;
+    int hoisted = 0;
+    int changed = 1;
+    
+    if (head == 0)
+        return 0;
+    
+    int before = unit->code[head - 1].op;
+    
+    if (before == JMP || before == RTN || before == SIO3 || before == TCL)
+        return 0;
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        if ((i < head || i > tail) && isJump(unit->code[i].op)
+            && unit->code[i].m >= head && unit->code[i].m <= tail)
+            return 0;
+    }
+    
+    char* definedInLoop = calloc(n + 1, 1);
+    char* invariantRegister = calloc(n + 1, 1);
+    char* invariant = calloc(tail - head + 1, 1);
+    frameSlot* stored = malloc((tail - head + 1) * sizeof(frameSlot));
+    
+    for (int i = head; i <= tail; i++) {
+        
+        instruction in = unit->code[i];
+        
+        if (registerFields(in.op) & DEFINES_R)
+            definedInLoop[in.r] = 1;
+        
+        if (in.op == STO && slotIndex(stored, storedCount, in.l, in.m) < 0) {
+            stored[storedCount].l = in.l;
+            stored[storedCount].m = in.m;
+            storedCount++;
+        }
+    }
+    
+    while (changed) {
+        
+        changed = 0;
+        
+        for (int i = head; i <= tail; i++) {
+            
+            instruction in = unit->code[i];
+            int fields = registerFields(in.op);
+            int canMove;
+            
+            if (invariant[i - head])
+                continue;
+            
+            if (in.op == LIT || in.op == ADR) {
+                canMove = 1;
+            }
+            else if (in.op == LDX || in.op == SUM) {
+                canMove = 0;
+            }
+            else if (in.op == LOD) {
+                canMove = slotIndex(stored, storedCount, in.l, in.m) < 0
+                          && ! callsChange(unit, head, tail, in.l, in.m);
+            }
+            else if ((fields & DEFINES_R) && (fields & USES_L) && in.op != DIV && in.op != MOD) {
+                canMove = ( ! definedInLoop[in.l] || invariantRegister[in.l])
+                          && ( ! (fields & USES_M) || ! definedInLoop[in.m] || invariantRegister[in.m]);
+            }
+            else {
+                canMove = 0;
+            }
+            
+            if (canMove) {
+                invariant[i - head] = 1;
+                invariantRegister[in.r] = 1;
+                hoisted++;
+                changed = 1;
+            }
+        }
+    }
+    
+    if (hoisted) {
+        
+        instruction* code = malloc((unit->capacity + 1) * sizeof(instruction));
+        int* newIndex = malloc((unit->length + 1) * sizeof(int));
+        int length = head;
+        
+        memcpy(code, unit->code, head * sizeof(instruction));
+        
+        for (int i = 0; i < head; i++) {
+            newIndex[i] = i;
+        }
+        
+        for (int i = head; i <= tail; i++) {
+            if (invariant[i - head])
+                code[length++] = unit->code[i];
+        }
+        
+        // The loop keeps its instructions after the preheader, moved ones land on the next that stays
+        for (int i = head; i < unit->length; i++) {
+            
+            newIndex[i] = length;
+            
+            if (i > tail || ! invariant[i - head])
+                code[length++] = unit->code[i];
+        }
+        
+        newIndex[unit->length] = length;
+        
+        free(unit->code);
+        unit->code = code;
+        
+        relocateJumps(unit, newIndex);
+        
+        free(newIndex);
+    }
+    
+    free(definedInLoop);
+    free(invariantRegister);
+    free(invariant);
+    free(stored);
+    
+    return hoisted > 0;
+}
+
+
+// Drop blocks no path from the unit entry reaches, and jumps to the next instruction
+int removeUnreachableCode(procedureUnit* unit) {
+    
+    int changed = 0;
+    int top = 0;
+    
+    basicBlock* blocks = malloc((unit->length + 1) * sizeof(basicBlock));
+    int* blockOf = malloc((unit->length + 1) * sizeof(int));
+    int blockCount = findBasicBlocks(unit, blocks, blockOf);
+    
+    char* reached = calloc(blockCount + 1, 1);
+    int* worklist = malloc((blockCount + 1) * sizeof(int));
+    char* removed = calloc(unit->length + 1, 1);
+    
+    reached[0] = 1;
+    worklist[top++] = 0;
+    
+    while (top > 0) {
+        
+        int b = worklist[--top];
+        
+        for (int s = 0; s < blocks[b].successorCount; s++) {
+            
+            int next = blocks[b].successors[s];
+            
+            if ( ! reached[next]) {
+                reached[next] = 1;
+                worklist[top++] = next;
+            }
+        }
+    }
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        if ( ! reached[blockOf[i]]) {
+            removed[i] = 1;
+            changed = 1;
+        }
+        else if (isJump(unit->code[i].op) && unit->code[i].m == i + 1) {
+            removed[i] = 1;
+            changed = 1;
+        }
+    }
+    
+    if (changed)
+        compactCode(unit, removed);
+    
+    free(blocks);
+    free(blockOf);
+    free(reached);
+    free(worklist);
+    free(removed);
+    
+    return changed;
+}
+
+
+// Remove stores to slots that are not read again before being overwritten or going out of scope
+// A call may read any slot the callee can see: everything for a procedure nested in this one,
+// only up-level slots otherwise. Up-level slots outlive the unit, its own frame dies at RTN
+int eliminateDeadStores(procedureUnit* unit) {
+    
+    frameSlot* slots;
+    int slotCount = collectSlots(unit, &slots);
+    int words = bitsetWords(slotCount);
+    int changed = 1;
+    int removedAny = 0;
+    
+    basicBlock* blocks = malloc((unit->length + 1) * sizeof(basicBlock));
+    int* blockOf = malloc((unit->length + 1) * sizeof(int));
+    int blockCount = findBasicBlocks(unit, blocks, blockOf);
+    
+    bitset* liveIn = malloc((blockCount + 1) * sizeof(bitset));
+    bitset live = newBitset(slotCount);
+    bitset upLevel = newBitset(slotCount);
+    bitset all = newBitset(slotCount);
+    char* removed = calloc(unit->length + 1, 1);
+    
+    for (int s = 0; s < slotCount; s++) {
+        
+        setBit(all, s);
+        
+        if (slots[s].l > 0)
+            setBit(upLevel, s);
+    }
+    
+    for (int b = 0; b < blockCount; b++) {
+        liveIn[b] = newBitset(slotCount);
+    }
+    
+    while (changed) {
+        
+        changed = 0;
+        
+        for (int b = blockCount - 1; b >= 0; b--) {
+            
+            liveSlotsOut(&blocks[b], liveIn, live, words);
+            liveSlotsBackward(unit, &blocks[b], live, slots, slotCount, upLevel, all, NULL);
+            
+            if (memcmp(live, liveIn[b], words * sizeof(unsigned int)) != 0) {
+                memcpy(liveIn[b], live, words * sizeof(unsigned int));
+                changed = 1;
+            }
+        }
+    }
+    
+    // Now that liveness is settled, a store to a slot not live after it is dead
+    for (int b = 0; b < blockCount; b++) {
+        liveSlotsOut(&blocks[b], liveIn, live, words);
+        liveSlotsBackward(unit, &blocks[b], live, slots, slotCount, upLevel, all, removed);
+    }
+    
+    for (int i = 0; i < unit->length; i++) {
+        removedAny |= removed[i];
+    }
+    
+    if (removedAny)
+        compactCode(unit, removed);
+    
+    for (int b = 0; b < blockCount; b++) {
+        free(liveIn[b]);
+    }
+    
+    free(slots);
+    free(blocks);
+    free(blockOf);
+    free(liveIn);
+    free(live);
+    free(upLevel);
+    free(all);
+    free(removed);
+    
+    return removedAny;
+}
+
+
+// Slots live on exit from a block, the union of what is live into its successors
+void liveSlotsOut(basicBlock* block, bitset* liveIn, bitset live, int words) {
+    
+    memset(live, 0, words * sizeof(unsigned int));
+    
+    for (int s = 0; s < block->successorCount; s++) {
+        for (int w = 0; w < words; w++) {
+            live[w] |= liveIn[block->successors[s]][w];
+        }
+    }
+}
+
+
+// Walk a block backward turning the slots live on exit into those live on entry
+// Stores found dead on the way are marked in removed, when given
+void liveSlotsBackward(procedureUnit* unit, basicBlock* block, bitset live, frameSlot* slots, int slotCount,
+                       bitset upLevel, bitset all, char* removed) {
+    
+    int words = bitsetWords(slotCount);
+    
+    for (int i = block->end - 1; i >= block->start; i--) {
+        
+        instruction in = unit->code[i];
+        
+        switch (in.op) {
+                
+            case LOD:
+                setBit(live, slotIndex(slots, slotCount, in.l, in.m));
+                break;
+            case STO:
+                if (removed && ! testBit(live, slotIndex(slots, slotCount, in.l, in.m)))
+                    removed[i] = 1;
+                clearBit(live, slotIndex(slots, slotCount, in.l, in.m));
+                break;
+            // Slots the callee or what it calls may read
+            case CAL:
+                for (int s = 0; s < slotCount; s++) {
+                    if (callTouches(unit, in, slots[s].l, slots[s].m, 0))
+                        setBit(live, s);
+                }
+                break;
+            // The frame a TCL reuses is as good as returned from
+            case RTN:
+            case TCL:
+                memcpy(live, upLevel, words * sizeof(unsigned int));
+                break;
+            case SIO3:
+                memset(live, 0, words * sizeof(unsigned int));
+                break;
+            // Reads through an address, only ever of array words but those were set by STO at a restart
+            case LDX:
+            case CPY:
+            case VAD:
+            case SUM:
+                memcpy(live, all, words * sizeof(unsigned int));
+                break;
+        }
+    }
+}
+
+
+// Remove instructions whose only effect is a register nobody reads
+int eliminateDeadCode(procedureUnit* unit) {
+    
+    int regs[3];
+    int removedAny = 0;
+    int changed = 1;
+    
+    int* uses = calloc(unit->registerCount + 1, sizeof(int));
+    char* removed = calloc(unit->length + 1, 1);
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        int count = instructionUses(unit->code[i], regs);
+        
+        for (int j = 0; j < count; j++) {
+            uses[regs[j]]++;
+        }
+    }
+    
+    while (changed) {
+        
+        changed = 0;
+        
+        for (int i = unit->length - 1; i >= 0; i--) {
+            
+            int def = instructionDefines(unit->code[i]);
+            
+            // Input is consumed even when the value is not needed
+            if (removed[i] || def < 0 || uses[def] > 0 || unit->code[i].op == SIO2)
+                continue;
+            
+            int count = instructionUses(unit->code[i], regs);
+            
+            for (int j = 0; j < count; j++) {
+                uses[regs[j]]--;
+            }
+            
+            removed[i] = 1;
+            removedAny = 1;
+            changed = 1;
+        }
+    }
+    
+    if (removedAny)
+        compactCode(unit, removed);
+    
+    free(uses);
+    free(removed);
+    
+    return removedAny;
+}
+
+
+// Delete the marked instructions, jumps to a removed instruction land on the next one kept
+void compactCode(procedureUnit* unit, char* removed) {
+    
+    int* newIndex = malloc((unit->length + 1) * sizeof(int));
+    int length = 0;
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        newIndex[i] = length;
+        
+        if ( ! removed[i])
+            unit->code[length++] = unit->code[i];
+    }
+    
+    newIndex[unit->length] = length;
+    unit->length = length;
+    
+    relocateJumps(unit, newIndex);
+    
+    free(newIndex);
+}
+
+
+// Collect the distinct slots loaded or stored by a unit, returns how many there are
+int collectSlots(procedureUnit* unit, frameSlot** slots) {
+    
+    int count = 0;
+    
+    *slots = malloc((unit->length + 1) * sizeof(frameSlot));
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction in = unit->code[i];
+        
+        if ((in.op == LOD || in.op == STO) && slotIndex(*slots, count, in.l, in.m) < 0) {
+            (*slots)[count].l = in.l;
+            (*slots)[count].m = in.m;
+            count++;
+        }
+    }
+    
+    return count;
+}
+
+
+// Position of a slot in a list from collectSlots(), -1 if absent
+int slotIndex(frameSlot* slots, int slotCount, int l, int m) {
+    
+    for (int s = 0; s < slotCount; s++) {
+        if (slots[s].l == l && slots[s].m == m)
+            return s;
+    }
+    
+    return -1;
+}
+
+
+// Whole program reachability over the call graph, starting from the main block
+void markReachableUnits() {
+    
+    int worklist[MAX_PROCEDURES];
+    int top = 0;
+    
+    units[0].reachable = 1;
+    worklist[top++] = 0;
+    
+    while (top > 0) {
+        
+        procedureUnit* unit = &units[worklist[--top]];
+        
+        for (int i = 0; i < unit->length; i++) {
+            
+            int callee = unit->code[i].m;
+            
+            if ((unit->code[i].op == CAL || unit->code[i].op == TCL) && ! units[callee].reachable) {
+                units[callee].reachable = 1;
+                worklist[top++] = callee;
+            }
+        }
+    }
+}
+
+
+// Substitute the bodies of small non-recursive procedures for their calls
+// Callees are handled before their callers so their size includes whatever was inlined into them
+void inlineProcedures() {
+    
+    int order[MAX_PROCEDURES];
+    int count = 0;
+    char recursive[MAX_PROCEDURES];
+    char visited[MAX_PROCEDURES];
+    
+    countProgram();
+    
+    for (int i = 0; i < unitCount; i++) {
+        memset(visited, 0, unitCount);
+        recursive[i] = callsUnit(i, i, visited);
+    }
+    
+    memset(visited, 0, unitCount);
+    
+    for (int i = 0; i < unitCount; i++) {
+        orderCallees(i, visited, order, &count);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (inlineCalls(&units[order[i]], recursive))
+            optimizeUnit(&units[order[i]]);
+    }
+}
+
+
+// Depth first over the call graph, listing every unit after the units it calls
+void orderCallees(int unit, char* visited, int* order, int* count) {
+    
+    if (visited[unit])
+        return;
+    
+    visited[unit] = 1;
+    
+    for (int i = 0; i < units[unit].length; i++) {
+        if (units[unit].code[i].op == CAL)
+            orderCallees(units[unit].code[i].m, visited, order, count);
+    }
+    
+    order[(*count)++] = unit;
+}
+
+
+// Whether a chain of calls leads from one unit to another
+int callsUnit(int from, int target, char* visited) {
+    
+    for (int i = 0; i < units[from].length; i++) {
+        
+        int op = units[from].code[i].op;
+        int callee = units[from].code[i].m;
+        
+        if ((op != CAL && op != TCL && op != LCL && op != MCL) || visited[callee])
+            continue;
+        
+        if (callee == target)
+            return 1;
+        
+        visited[callee] = 1;
+        
+        if (callsUnit(callee, target, visited))
+            return 1;
+    }
+    
+    return 0;
+}
+
+
+// A procedure can be inlined when it is small, not recursive, returns only at its end and
+// calls none of its own nested procedures, which would need its frame for their static link
+int canInline(int callee, char* recursive) {
+    
+    procedureUnit* unit = &units[callee];
+    
+    // A profile can show a procedure never ran, or ran often enough to be worth a larger copy
+    // One inlined everywhere in the profiled code is judged by the runs of its own jumps instead
+    long calls = unitCalls[callee];
+    
+    for (int s = 1; s <= siteCount && ! unitProfiled[callee]; s++) {
+        if (siteUnit[s] == callee && siteRuns[s] > calls)
+            calls = siteRuns[s];
+    }
+    
+    int budget = profiled && calls >= HOT_CALLS ? 4 * inlineBudget : inlineBudget;
+    
+    if (callee == 0 || recursive[callee] || unit->length - 2 > budget)
+        return 0;
+    
+    if (unitProfiled[callee] && unitCalls[callee] == 0)
+        return 0;
+    
+    if (unit->code[0].op != INC || unit->code[unit->length - 1].op != RTN)
+        return 0;
+    
+    for (int i = 1; i < unit->length - 1; i++) {
+        
+        int op = unit->code[i].op;
+        
+        if (op == RTN || op == SIO3 || (op == CAL && unit->code[i].l == 0))
+            return 0;
+    }
+    
+    return 1;
+}
+
+
+// Replace the calls of a unit to inlinable procedures with their bodies, returns whether any was
+// The callee's locals move past the caller's frame into a region shared by every inlined body,
+// as they never run at the same time. Up-level addresses are rebased on the call's static link
+int inlineCalls(procedureUnit* caller, char* recursive) {
+    
+    int base = caller->code[0].m;
+    int region = 0;
+    int changed = 0;
+    int* newIndex = malloc((caller->length + 1) * sizeof(int));
+    
+    procedureUnit rewritten = *caller;
+    rewritten.code = NULL;
+    rewritten.length = 0;
+    rewritten.capacity = 0;
+    
+    for (int i = 0; i < caller->length; i++) {
+        
+        instruction call = caller->code[i];
+        
+        newIndex[i] = rewritten.length;
+        
+        // The copy takes the place of the CAL, less the callee's INC and RTN
+        if (call.op != CAL || ! canInline(call.m, recursive) || ! growProgram(units[call.m].length - 3)) {
+            appendCode(&rewritten, call);
+            continue;
+        }
+        
+        procedureUnit* callee = &units[call.m];
+        int start = rewritten.length;
+        int* renamed = malloc((callee->registerCount + 1) * sizeof(int));
+        
+        for (int v = 0; v < callee->registerCount; v++) {
+            renamed[v] = rewritten.registerCount++;
+        }
+        
+        // Body without the INC and the RTN
+        for (int j = 1; j < callee->length - 1; j++) {
+            
+            instruction in = callee->code[j];
+            int fields = registerFields(in.op);
+            
+            if (fields & (USES_R | DEFINES_R))
+                in.r = renamed[in.r];
+            if (fields & USES_L)
+                in.l = renamed[in.l];
+            if (fields & USES_M)
+                in.m = renamed[in.m];
+            
+            if (isJump(in.op))
+                in.m = start + in.m - 1;
+            else if ((in.op == LOD || in.op == STO || in.op == ADR) && in.l == 0)
+                in.m = base + in.m - 4;
+            else if (in.op == LOD || in.op == STO || in.op == ADR || in.op == CAL)
+                in.l = in.l - 1 + call.l;
+            
+            appendCode(&rewritten, in);
+        }
+        
+        if (callee->code[0].m - 4 > region)
+            region = callee->code[0].m - 4;
+        
+        free(renamed);
+        changed = 1;
+    }
+    
+    newIndex[caller->length] = rewritten.length;
+    
+    if (changed) {
+        
+        // Only the caller's own jumps need relocating, the inlined ones are already in place
+        for (int i = 0; i < caller->length; i++) {
+            
+            instruction* in = &rewritten.code[newIndex[i]];
+            
+            if (caller->code[i].op != CAL && isJump(in->op))
+                in->m = newIndex[in->m];
+        }
+        
+        rewritten.code[0].m += region;
+        
+        free(caller->code);
+        *caller = rewritten;
+    }
+    else {
+        free(rewritten.code);
+    }
+    
+    free(newIndex);
+    
+    return changed;
+}
+
+
+// Unroll the innermost counted loops of a unit, returns whether any changed
+// Loops are taken from the last to the first, so rewriting one leaves the positions of the rest alone
+int unrollLoops(procedureUnit* unit) {
+    
+    int changed = 0;
+    
+    for (int j = unit->length - 1; j >= 0; j--) {
+        
+        instruction in = unit->code[j];
+        
+        if (in.op == JPT && in.m <= j) {
+            changed |= unrollLoop(unit, in.m, j);
+            j = in.m;
+        }
+    }
+    
+    return changed;
+}
+
+
+// Unroll the loop [head, tail] when it counts a slot by a constant step up or down to an invariant bound
+// The slot must be stored once per iteration, in the block that closes the loop, with its value on
+// entry to the iteration plus the step, and the closing JPT must compare that sum with the bound.
+// Calls that could store to the slot rule the loop out. A small constant trip count is unrolled
+// completely, anything else by unrollFactor ahead of the original loop, which finishes the count
+int unrollLoop(procedureUnit* unit, int head, int tail) {
+    
+    int length = tail - head;
+    int n = unit->registerCount;
+    int stores = 0;
+    int store = -1;
+    int unrolled = 0;
+    
+    if (head == 0 || length == 0)
+        return 0;
+    
+    int before = unit->code[head - 1].op;
+    
+    if (before == JMP || before == RTN || before == SIO3 || before == TCL)
+        return 0;
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction in = unit->code[i];
+        int inside = i >= head && i <= tail;
+        
+        if (isJump(in.op) && inside != (in.m >= head && in.m <= tail))
+            return 0;
+        
+        // Innermost loops only
+        if (inside && i < tail && isJump(in.op) && in.m <= i)
+            return 0;
+    }
+    
+    int* definition = malloc((n + 1) * sizeof(int));
+    int* uses = malloc((n + 1) * sizeof(int));
+    basicBlock* blocks = malloc((unit->length + 1) * sizeof(basicBlock));
+    int* blockOf = malloc((unit->length + 1) * sizeof(int));
+    
+    countDefinitions(unit, definition, uses);
+    findBasicBlocks(unit, blocks, blockOf);
+    
+    int compare = definition[unit->code[tail].r];
+    instruction test = unit->code[compare >= 0 ? compare : tail];
+    
+    // The stored sum, the only store to its slot in the loop
+    for (int i = blocks[blockOf[tail]].start; i < tail && compare >= head && compare < tail; i++) {
+        
+        instruction in = unit->code[i];
+        
+        if (in.op == STO && (in.r == test.l || in.r == test.m))
+            store = i;
+    }
+    
+    for (int i = head; i < tail && store >= 0; i++) {
+        
+        instruction in = unit->code[i];
+        
+        if (in.op == STO && in.l == unit->code[store].l && in.m == unit->code[store].m)
+            stores++;
+    }
+    
+    if (store >= 0 && stores == 1 && test.op >= LSS && test.op <= GEQ
+        && ! callsChange(unit, head, tail, unit->code[store].l, unit->code[store].m)) {
+        
+        instruction slot = unit->code[store];
+        int sum = slot.r;
+        int bound = test.l == sum ? test.m : test.l;
+        
+        // Relation of the sum to the bound, whichever side each was on
+        int relation = test.l == sum ? test.op : test.op == LSS ? GTR : test.op == LEQ ? GEQ : test.op == GTR ? LSS : LEQ;
+        
+        instruction step = unit->code[definition[sum]];
+        int start = -1;
+        int increment = 0;
+        
+        if (step.op == ADD || step.op == SUB) {
+            
+            for (int side = 0; side < 2; side++) {
+                
+                int value = side == 0 ? step.l : step.m;
+                int other = side == 0 ? step.m : step.l;
+                
+                if (side == 1 && step.op == SUB)
+                    break;
+                
+                if (definition[value] >= head && unit->code[definition[value]].op == LOD
+                    && unit->code[definition[value]].l == slot.l && unit->code[definition[value]].m == slot.m
+                    && definition[other] >= 0 && unit->code[definition[other]].op == LIT) {
+                    start = value;
+                    increment = step.op == ADD ? unit->code[definition[other]].m : -unit->code[definition[other]].m;
+                }
+            }
+        }
+        
+        int constantBound = definition[bound] >= 0 && unit->code[definition[bound]].op == LIT;
+        int invariantBound = constantBound || definition[bound] < head || definition[bound] > tail;
+        int counting = ((relation == LSS || relation == LEQ) && increment > 0)
+                       || ((relation == GTR || relation == GEQ) && increment < 0);
+        
+        if (start >= 0 && counting && invariantBound && bound != sum) {
+            
+            int limit = constantBound ? unit->code[definition[bound]].m : 0;
+            int first;
+            int trips = 0;
+            
+            if (constantBound && entryValue(unit, head, slot.l, slot.m, &first)) {
+                
+                long long value = first;
+                
+                do {
+                    trips++;
+                    value += increment;
+                } while (trips * length <= UNROLL_BUDGET && value >= INT_MIN && value <= INT_MAX
+                         && holdsRelation(relation, value, limit));
+                
+                if (value < INT_MIN || value > INT_MAX || trips * length > UNROLL_BUDGET)
+                    trips = 0;
+            }
+            
+            if (trips > 0 && growProgram((trips - 1) * (length + 1))) {
+                unrollCompletely(unit, head, tail, trips);
+                unrolled = 1;
+            }
+            else if (unrollFactor > 1 && 2 * length <= UNROLL_BUDGET
+                     && ! escapesLoop(unit, head, tail, definition, blocks[blockOf[tail]].start)) {
+                
+                int factor = unrollFactor * length <= UNROLL_BUDGET ? unrollFactor : UNROLL_BUDGET / length;
+                long long ahead = (long long)(factor - 1) * increment;
+                
+                // The copies, the guards around them and the original loop left for the last iterations
+                if (( ! constantBound || (limit - ahead >= INT_MIN && limit - ahead <= INT_MAX))
+                    && growProgram(factor * (length + 1) + 10)) {
+                    unrollByFactor(unit, head, tail, factor, compare, slot, relation, bound, constantBound, limit, (int)ahead,
+                                   definition, blocks[blockOf[tail]].start);
+                    unrolled = 1;
+                }
+            }
+        }
+    }
+    
+    free(definition);
+    free(uses);
+    free(blocks);
+    free(blockOf);
+    
+    return unrolled;
+}
+
+
+// Value of the constant stored to slot (l, m) on the way into head, when the code falling into head
+// stores one with nothing in between that could change it
+int entryValue(procedureUnit* unit, int head, int l, int m, int* value) {
+    
+    char* target = calloc(unit->length + 1, 1);
+    int found = 0;
+    
+    for (int i = 0; i < unit->length; i++) {
+        if (isJump(unit->code[i].op))
+            target[unit->code[i].m] = 1;
+    }
+    
+    for (int k = head - 1; k >= 0; k--) {
+        
+        instruction in = unit->code[k];
+        
+        if (in.op == CAL || in.op == JMP || in.op == RTN || in.op == SIO3 || in.op == TCL)
+            break;
+        
+        if (in.op == STO && in.l == l && in.m == m) {
+            
+            for (int d = k - 1; d >= 0; d--) {
+                if (instructionDefines(unit->code[d]) == in.r) {
+                    found = unit->code[d].op == LIT;
+                    *value = unit->code[d].m;
+                    break;
+                }
+            }
+            
+            break;
+        }
+        
+        // Other paths meet here
+        if (target[k])
+            break;
+    }
+    
+    free(target);
+    
+    return found;
+}
+
+
+// Whether a register defined in [head, tail] is read outside of it, other than one exitStore() finds
+// a slot for that it can be reloaded from once the loop is done
+int escapesLoop(procedureUnit* unit, int head, int tail, int* definition, int closing) {
+    
+    int regs[3];
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        if (i >= head && i <= tail)
+            continue;
+        
+        int count = instructionUses(unit->code[i], regs);
+        
+        for (int j = 0; j < count; j++) {
+            if (definition[regs[j]] >= head && definition[regs[j]] <= tail
+                && exitStore(unit, head, tail, regs[j], closing) < 0)
+                return 1;
+        }
+    }
+    
+    return 0;
+}
+
+
+// Store of reg in the block from closing to the end of the loop [head, tail], the only store to its slot
+// in the loop, so the slot holds reg whenever the loop is left. Returns -1 if there is none
+int exitStore(procedureUnit* unit, int head, int tail, int reg, int closing) {
+    
+    int store = -1;
+    int stores = 0;
+    
+    for (int k = closing; k < tail; k++) {
+        if (unit->code[k].op == STO && unit->code[k].r == reg)
+            store = k;
+    }
+    
+    for (int k = head; k < tail && store >= 0; k++) {
+        
+        instruction in = unit->code[k];
+        
+        if (in.op == STO && in.l == unit->code[store].l && in.m == unit->code[store].m)
+            stores++;
+    }
+    
+    return stores == 1 ? store : -1;
+}
+
+
+// Whether a relation from LSS to GEQ holds between a and b
+int holdsRelation(int relation, long long a, long long b) {
+    
+    switch (relation) {
+        case LSS:
+            return a < b;
+        case LEQ:
+            return a <= b;
+        case GTR:
+            return a > b;
+        default:
+            return a >= b;
+    }
+}
+
+
+// Replace the loop [head, tail] by trips copies of its body, the last one keeping the original registers
+// since the code after the loop may read them
+void unrollCompletely(procedureUnit* unit, int head, int tail, int trips) {
+    
+    procedureUnit middle = *unit;
+    middle.code = NULL;
+    middle.length = 0;
+    middle.capacity = 0;
+    
+    for (int t = 0; t < trips; t++) {
+        copyLoopBody(unit, &middle, head, tail, t < trips - 1, -1, -1, -1);
+    }
+    
+    spliceLoop(unit, &middle, head, tail);
+}
+
+
+// Ahead of the loop [head, tail] run a loop of factor copies of its body for as long as the relation
+// still holds factor - 1 steps further on, then let the original loop take what is left. The bound for
+// the unrolled loop is computed once, and a bound that wraps around skips straight to the original loop
+// The original loop may now be skipped, so registers it defines that are read after it are reloaded
+void unrollByFactor(procedureUnit* unit, int head, int tail, int factor, int compare, instruction slot,
+                    int relation, int bound, int constantBound, int value, int ahead, int* definition, int closing) {
+    
+    int mask[3] = { USES_R, USES_L, USES_M };
+    
+    procedureUnit middle = *unit;
+    middle.code = NULL;
+    middle.length = 0;
+    middle.capacity = 0;
+    
+    int limit;
+    int near;
+    int skips[2];
+    int skipCount = 0;
+    
+    // A constant bound may be loaded inside the loop, the guard of the original loop needs it outside
+    if (constantBound) {
+        limit = emitOperation(&middle, LIT, 0, value);
+        near = emitOperation(&middle, LIT, 0, value - ahead);
+    }
+    else {
+        
+        int distance = emitOperation(&middle, LIT, 0, ahead);
+        
+        limit = bound;
+        near = emitOperation(&middle, SUB, bound, distance);
+        
+        int wrapped = emitOperation(&middle, ahead > 0 ? GTR : LSS, near, bound);
+        
+        skips[skipCount++] = middle.length;
+        appendInstruction(&middle, JPT, wrapped, 0, 0);
+    }
+    
+    int current = emitOperation(&middle, LOD, slot.l, slot.m);
+    int enter = emitOperation(&middle, relation, current, near);
+    
+    skips[skipCount++] = middle.length;
+    appendInstruction(&middle, JPC, enter, 0, 0);
+    
+    int loop = middle.length;
+    int again = -1;
+    
+    for (int c = 0; c < factor; c++) {
+        again = copyLoopBody(unit, &middle, head, tail, 1, c == factor - 1 ? compare : -1, bound, near);
+    }
+    
+    appendInstruction(&middle, JPT, again, 0, loop);
+    
+    // The original loop, behind a guard of its own
+    for (int s = 0; s < skipCount; s++) {
+        middle.code[skips[s]].m = middle.length;
+    }
+    
+    current = emitOperation(&middle, LOD, slot.l, slot.m);
+    enter = emitOperation(&middle, relation, current, limit);
+    
+    int guard = middle.length;
+    appendInstruction(&middle, JPC, enter, 0, 0);
+    
+    int original = middle.length;
+    
+    for (int i = head; i <= tail; i++) {
+        
+        instruction in = unit->code[i];
+        
+        if (isJump(in.op))
+            in.m = original + in.m - head;
+        
+        appendCode(&middle, in);
+    }
+    
+    middle.code[guard].m = middle.length;
+    
+    int* reload = malloc((unit->registerCount + 1) * sizeof(int));
+    
+    for (int v = 0; v < unit->registerCount; v++) {
+        reload[v] = -1;
+    }
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        int fields = registerFields(unit->code[i].op);
+        int* operand[3] = { &unit->code[i].r, &unit->code[i].l, &unit->code[i].m };
+        
+        for (int f = 0; f < 3 && (i < head || i > tail); f++) {
+            
+            int reg = *operand[f];
+            
+            if ( ! (fields & mask[f]) || definition[reg] < head || definition[reg] > tail)
+                continue;
+            
+            if (reload[reg] < 0) {
+                
+                instruction store = unit->code[exitStore(unit, head, tail, reg, closing)];
+                
+                reload[reg] = emitOperation(&middle, LOD, store.l, store.m);
+            }
+            
+            *operand[f] = reload[reg];
+        }
+    }
+    
+    free(reload);
+    
+    spliceLoop(unit, &middle, head, tail);
+}
+
+
+// Append a copy of the body [head, tail) of a loop to middle, returns the register the closing JPT
+// tests in the copy. With rename set the registers it defines are fresh. At compare, the bound is
+// replaced by near
+int copyLoopBody(procedureUnit* unit, procedureUnit* middle, int head, int tail, int rename,
+                 int compare, int bound, int near) {
+    
+    int base = middle->length;
+    int mask[3] = { USES_R, USES_L, USES_M };
+    int* renamed = malloc((middle->registerCount + 1) * sizeof(int));
+    
+    for (int v = 0; v < middle->registerCount; v++) {
+        renamed[v] = v;
+    }
+    
+    for (int i = head; i < tail; i++) {
+        
+        instruction in = unit->code[i];
+        int fields = registerFields(in.op);
+        int* operand[3] = { &in.r, &in.l, &in.m };
+        
+        for (int f = 0; f < 3; f++) {
+            if (fields & mask[f])
+                *operand[f] = i == compare && *operand[f] == bound ? near : renamed[*operand[f]];
+        }
+        
+        if ((fields & DEFINES_R) && rename) {
+            renamed[in.r] = middle->registerCount;
+            in.r = middle->registerCount++;
+        }
+        
+        if (isJump(in.op))
+            in.m = base + in.m - head;
+        
+        appendCode(middle, in);
+    }
+    
+    int tested = renamed[unit->code[tail].r];
+    
+    free(renamed);
+    
+    return tested;
+}
+
+
+// Put the code of middle in place of the loop [head, tail], its jumps being relative to its start
+void spliceLoop(procedureUnit* unit, procedureUnit* middle, int head, int tail) {
+    
+    int shift = middle->length - (tail + 1 - head);
+    
+    procedureUnit rewritten = *middle;
+    rewritten.code = NULL;
+    rewritten.length = 0;
+    rewritten.capacity = 0;
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction in = unit->code[i];
+        
+        if (i == head) {
+            
+            for (int j = 0; j < middle->length; j++) {
+                
+                instruction moved = middle->code[j];
+                
+                if (isJump(moved.op))
+                    moved.m += head;
+                
+                appendCode(&rewritten, moved);
+            }
+        }
+        
+        if (i >= head && i <= tail)
+            continue;
+        
+        if (isJump(in.op) && in.m > tail)
+            in.m += shift;
+        
+        appendCode(&rewritten, in);
+    }
+    
+    free(unit->code);
+    free(middle->code);
+    *unit = rewritten;
+}
+
+
+// Append an instruction with the given fields
+void appendInstruction(procedureUnit* unit, int op, int r, int l, int m) {
+    
+    instruction in;
+    
+    in.op = op;
+    in.r = r;
+    in.l = l;
+    in.m = m;
+    in.site = 0;
+    in.line = 0;
+    
+    appendCode(unit, in);
+}
+
+
+// Turn the innermost loops that fill, copy, add up or sum runs of array elements into the bulk opcodes
+// FIL, CPY, VAD and SUM, returns whether any changed
+int vectorizeLoops(procedureUnit* unit) {
+    
+    int changed = 0;
+    
+    for (int j = unit->length - 1; j >= 0; j--) {
+        
+        instruction in = unit->code[j];
+        
+        if (in.op == JPT && in.m <= j) {
+            changed |= vectorizeLoop(unit, in.m, j);
+            j = in.m;
+        }
+    }
+    
+    return changed;
+}
+
+
+// Replace the loop [head, tail] by a bulk operation when it counts a slot i up by one to an invariant
+// bound and otherwise does nothing but one of
+//     a[i] := v              FIL
+//     a[i] := b[i]           CPY
+//     a[i] := a[i] + b[i]    VAD
+//     s := s + b[i]          SUM
+// The body has no jumps, so it runs max(1, bound - i) times, one more when the loop closes on i <= bound
+// as a for loop does. Checking the first and the last index
+// against the smallest of the arrays covers every index in between
+int vectorizeLoop(procedureUnit* unit, int head, int tail) {
+    
+    int n = unit->registerCount;
+    int length = tail - head;
+    int vectorized = 0;
+    
+    if (head == 0 || length == 0)
+        return 0;
+    
+    int before = unit->code[head - 1].op;
+    
+    if (before == JMP || before == RTN || before == SIO3 || before == TCL)
+        return 0;
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction in = unit->code[i];
+        
+        if (isJump(in.op) && i != tail && ((i >= head && i < tail) || (in.m >= head && in.m <= tail)))
+            return 0;
+    }
+    
+    int* definition = malloc((n + 1) * sizeof(int));
+    int* uses = malloc((n + 1) * sizeof(int));
+    char* kept = calloc(length + 1, 1);
+    int loads[2];
+    int loadCount = 0;
+    int store = -1;
+    int add = -1;
+    int counterStore = -1;
+    int sumLoad = -1;
+    int sumStore = -1;
+    int limit = INT_MAX;
+    int regs[3];
+    
+    countDefinitions(unit, definition, uses);
+    
+    int compare = definition[unit->code[tail].r];
+    instruction test = unit->code[compare >= head && compare < tail ? compare : tail];
+    int sum = test.l;
+    int bound = test.m;
+    int increment = test.op == LSS || test.op == LEQ ? definition[sum] : -1;
+    int start = -1;
+    int one = -1;
+    
+    if (increment >= head && increment < tail && unit->code[increment].op == ADD) {
+        
+        for (int side = 0; side < 2; side++) {
+            
+            int value = side == 0 ? unit->code[increment].l : unit->code[increment].m;
+            int other = side == 0 ? unit->code[increment].m : unit->code[increment].l;
+            
+            if (definition[value] >= head && definition[value] < tail && unit->code[definition[value]].op == LOD
+                && definition[other] >= 0 && unit->code[definition[other]].op == LIT && unit->code[definition[other]].m == 1) {
+                start = value;
+                one = other;
+            }
+        }
+    }
+    
+    int ok = start >= 0 && bound != sum && bound != start;
+    instruction counter = unit->code[ok ? definition[start] : tail];
+    
+    for (int i = head; i < tail && ok; i++) {
+        
+        instruction in = unit->code[i];
+        int stored = 0;
+        
+        for (int k = head; k < tail && in.op == LOD; k++) {
+            if (unit->code[k].op == STO && unit->code[k].l == in.l && unit->code[k].m == in.m)
+                stored = 1;
+        }
+        
+        switch (in.op) {
+                
+            case LIT:
+            case ADR:
+                kept[i - head] = 1;
+                break;
+                
+            case LOD:
+                if (in.l == counter.l && in.m == counter.m)
+                    ok = i == definition[start];
+                else if (stored && sumLoad < 0)
+                    sumLoad = i;
+                else
+                    ok = ! stored;
+                
+                kept[i - head] = i != sumLoad;
+                break;
+                
+            case CHK:
+                ok = in.r == start;
+                limit = in.m < limit ? in.m : limit;
+                break;
+                
+            case LDX:
+                ok = in.m == start && loadCount < 2;
+                loads[loadCount++ % 2] = i;
+                break;
+                
+            case STX:
+                ok = in.m == start && store < 0;
+                store = i;
+                break;
+                
+            case ADD:
+                ok = i == increment || add < 0;
+                add = i == increment ? add : i;
+                break;
+                
+            case STO:
+                if (in.l == counter.l && in.m == counter.m) {
+                    ok = in.r == sum && i > definition[start];
+                    counterStore = i;
+                }
+                else {
+                    ok = sumStore < 0;
+                    sumStore = i;
+                }
+                break;
+                
+            default:
+                ok = i == compare;
+                break;
+        }
+    }
+    
+    ok = ok && counterStore >= 0 && limit < INT_MAX && isInvariant(unit, head, tail, definition, bound);
+    
+    int kernel = -1;
+    int to = -1;
+    int from = -1;
+    int value = -1;
+    
+    if (ok && store >= 0 && loadCount == 0 && add < 0 && sumLoad < 0 && sumStore < 0) {
+        
+        value = unit->code[store].r;
+        
+        if (value != start && isInvariant(unit, head, tail, definition, value)) {
+            kernel = FIL;
+            to = unit->code[store].l;
+        }
+    }
+    
+    if (ok && store >= 0 && loadCount == 1 && add < 0 && sumLoad < 0 && sumStore < 0) {
+        
+        instruction load = unit->code[loads[0]];
+        
+        if (unit->code[store].r == load.r && uses[load.r] == 1 && ! sameArray(unit, definition, unit->code[store].l, load.l)) {
+            kernel = CPY;
+            to = unit->code[store].l;
+            from = load.l;
+        }
+    }
+    
+    if (ok && store >= 0 && loadCount == 2 && add >= 0 && sumLoad < 0 && sumStore < 0) {
+        
+        instruction sumOf = unit->code[add];
+        
+        for (int k = 0; k < 2; k++) {
+            
+            instruction mine = unit->code[loads[k]];
+            instruction other = unit->code[loads[1 - k]];
+            
+            if (((sumOf.l == mine.r && sumOf.m == other.r) || (sumOf.l == other.r && sumOf.m == mine.r))
+                && unit->code[store].r == sumOf.r && uses[sumOf.r] == 1 && uses[mine.r] == 1 && uses[other.r] == 1
+                && mine.r != other.r && sameArray(unit, definition, unit->code[store].l, mine.l)) {
+                kernel = VAD;
+                to = unit->code[store].l;
+                from = other.l;
+            }
+        }
+    }
+    
+    if (ok && store < 0 && loadCount == 1 && add >= 0 && sumLoad >= 0 && sumStore >= 0) {
+        
+        instruction sumOf = unit->code[add];
+        instruction load = unit->code[loads[0]];
+        instruction total = unit->code[sumLoad];
+        
+        // The sum may be read after the loop, but inside it only by its store
+        int reads = 0;
+        
+        for (int i = head; i < tail; i++) {
+            
+            int count = instructionUses(unit->code[i], regs);
+            
+            for (int j = 0; j < count; j++) {
+                reads += regs[j] == sumOf.r;
+            }
+        }
+        
+        if (((sumOf.l == total.r && sumOf.m == load.r) || (sumOf.l == load.r && sumOf.m == total.r))
+            && unit->code[sumStore].r == sumOf.r && unit->code[sumStore].l == total.l && unit->code[sumStore].m == total.m
+            && reads == 1 && uses[load.r] == 1 && uses[total.r] == 1 && sumLoad < sumStore) {
+            kernel = SUM;
+            from = load.l;
+        }
+    }
+    
+    // Nothing but the kept definitions, the counter and a sum may be read after the loop
+    for (int i = 0; i < unit->length && kernel >= 0; i++) {
+        
+        if (i >= head && i <= tail)
+            continue;
+        
+        int count = instructionUses(unit->code[i], regs);
+        
+        for (int j = 0; j < count; j++) {
+            if (definition[regs[j]] >= head && definition[regs[j]] <= tail && regs[j] != sum
+                && ! (kernel == SUM && regs[j] == unit->code[add].r) && ! kept[definition[regs[j]] - head])
+                kernel = -1;
+        }
+    }
+    
+    if (kernel >= 0 && (to < 0 || sameArray(unit, definition, to, to)) && (from < 0 || sameArray(unit, definition, from, from))) {
+        
+        procedureUnit middle = *unit;
+        middle.code = NULL;
+        middle.length = 0;
+        middle.capacity = 0;
+        
+        for (int i = head; i < tail; i++) {
+            if (kept[i - head])
+                appendCode(&middle, unit->code[i]);
+        }
+        
+        // count = more ? bound - start, plus one for <=, : 1, in straight code
+        int more = middle.registerCount++;
+        int left = middle.registerCount++;
+        int rest = middle.registerCount++;
+        int extra = middle.registerCount++;
+        int count = middle.registerCount++;
+        int last = middle.registerCount++;
+        
+        appendInstruction(&middle, CHK, start, 0, limit);
+        appendInstruction(&middle, test.op, more, start, bound);
+        appendInstruction(&middle, SUB, left, bound, start);
+        
+        if (test.op == LSS)
+            appendInstruction(&middle, SUB, rest, left, one);
+        else
+            rest = left;
+        
+        appendInstruction(&middle, MUL, extra, more, rest);
+        appendInstruction(&middle, ADD, count, extra, one);
+        appendInstruction(&middle, ADD, sum, start, count);
+        appendInstruction(&middle, SUB, last, sum, one);
+        appendInstruction(&middle, CHK, last, 0, limit);
+        
+        int target = middle.registerCount++;
+        int source = middle.registerCount++;
+        
+        if (to >= 0)
+            appendInstruction(&middle, ADD, target, to, start);
+        if (from >= 0)
+            appendInstruction(&middle, ADD, source, from, start);
+        
+        if (kernel == FIL)
+            appendInstruction(&middle, FIL, target, value, count);
+        else if (kernel != SUM)
+            appendInstruction(&middle, kernel, target, source, count);
+        else {
+            
+            int part = middle.registerCount++;
+            instruction sumOf = unit->code[add];
+            
+            appendCode(&middle, unit->code[sumLoad]);
+            appendInstruction(&middle, SUM, part, source, count);
+            appendInstruction(&middle, ADD, sumOf.r, unit->code[sumLoad].r, part);
+            appendCode(&middle, unit->code[sumStore]);
+        }
+        
+        appendCode(&middle, unit->code[counterStore]);
+        
+        spliceLoop(unit, &middle, head, tail);
+        vectorized = 1;
+    }
+    
+    free(definition);
+    free(uses);
+    free(kept);
+    
+    return vectorized;
+}
+
+
+// Whether reg holds the same value all through the loop [head, tail], defined before it or by a constant,
+// an address or a load of a slot the loop does not store to
+int isInvariant(procedureUnit* unit, int head, int tail, int* definition, int reg) {
+    
+    int d = definition[reg];
+    
+    if (d < head || d > tail)
+        return d >= 0;
+    
+    instruction in = unit->code[d];
+    
+    if (in.op == LIT || in.op == ADR)
+        return 1;
+    
+    if (in.op != LOD)
+        return 0;
+    
+    for (int k = head; k < tail; k++) {
+        if (unit->code[k].op == STO && unit->code[k].l == in.l && unit->code[k].m == in.m)
+            return 0;
+    }
+    
+    return 1;
+}
+
+
+// Whether the registers a and b hold the addresses of the same array, both being set by an ADR
+int sameArray(procedureUnit* unit, int* definition, int a, int b) {
+    
+    if (definition[a] < 0 || definition[b] < 0)
+        return 0;
+    
+    instruction x = unit->code[definition[a]];
+    instruction y = unit->code[definition[b]];
+    
+    return x.op == ADR && y.op == ADR && x.l == y.l && x.m == y.m;
+}
+
+
+// Turn calls the unit returns straight after into TCLs, which hand the current frame to the callee
+// A call to a nested procedure keeps its CAL, the callee reaches into the frame through its static link.
+// A procedure calling itself just starts over in its own frame, returns whether any changed
+int eliminateTailCalls(procedureUnit* unit) {
+    
+    int changed = 0;
+    int self = unit - units;
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction* in = &unit->code[i];
+        
+        if (in->op != CAL || in->l == 0)
+            continue;
+        
+        // Follow the jumps after the call, a loop of them never reaches a return
+        int next = i + 1;
+        
+        for (int hops = 0; hops < unit->length && next < unit->length && unit->code[next].op == JMP; hops++) {
+            next = unit->code[next].m;
+        }
+        
+        if (next >= unit->length || unit->code[next].op != RTN)
+            continue;
+        
+        if (in->m == self && in->l == 1) {
+            in->op = JMP;
+            in->l = 0;
+            in->m = 1;
+        }
+        else {
+            in->op = TCL;
+        }
+        
+        changed = 1;
+    }
+    
+    return changed;
+}
+
+
+// Work out what every procedure may do to frames other than its own, taking in what the procedures
+// it calls may do, until nothing changes. Recursion only needs the repeat, what a unit may do grows
+// with each pass and there are finitely many slots
+void summarizeEffects() {
+    
+    int capacity = 0;
+    int changed = 1;
+    
+    for (int u = 0; u < unitCount; u++) {
+        capacity += units[u].length;
+    }
+    
+    // Every slot a unit names, by its level counted from the main block and its address
+    effectSlots = malloc((capacity + 1) * sizeof(frameSlot));
+    effectSlotCount = 0;
+    
+    for (int u = 0; u < unitCount; u++) {
+        for (int i = 0; i < units[u].length; i++) {
+            
+            instruction in = units[u].code[i];
+            int level = units[u].level - in.l;
+            
+            if ((in.op == LOD || in.op == STO) && effectSlot(level, in.m) < 0) {
+                effectSlots[effectSlotCount].l = level;
+                effectSlots[effectSlotCount].m = in.m;
+                effectSlotCount++;
+            }
+        }
+    }
+    
+    for (int u = 0; u < unitCount; u++) {
+        unitReads[u] = newBitset(effectSlotCount);
+        unitWrites[u] = newBitset(effectSlotCount);
+    }
+    
+    while (changed) {
+        
+        changed = 0;
+        
+        for (int u = 0; u < unitCount; u++) {
+            changed |= summarizeUnit(u);
+        }
+    }
+}
+
+
+// Add to what the unit may do what its own code and its callees do, returns whether that grew
+// Its own frame is left out, as each call gets a fresh one
+int summarizeUnit(int unit) {
+    
+    procedureUnit* body = &units[unit];
+    int changed = 0;
+    
+    for (int i = 0; i < body->length; i++) {
+        
+        instruction in = body->code[i];
+        int level = body->level - in.l;
+        
+        if ((in.op == LOD || in.op == STO) && level < body->level) {
+            
+            bitset effects = in.op == LOD ? unitReads[unit] : unitWrites[unit];
+            int s = effectSlot(level, in.m);
+            
+            if ( ! testBit(effects, s)) {
+                setBit(effects, s);
+                changed = 1;
+            }
+        }
+        else if (in.op == ADR && level < body->level && ! unitAddresses[unit]) {
+            unitAddresses[unit] = 1;
+            changed = 1;
+        }
+        else if (in.op == SIO2 && ! unitInput[unit]) {
+            unitInput[unit] = 1;
+            changed = 1;
+        }
+        else if ((in.op == SIO1 || in.op == SIO3) && ! unitOutput[unit]) {
+            unitOutput[unit] = 1;
+            changed = 1;
+        }
+        else if (in.op == CAL || in.op == TCL) {
+            
+            int callee = in.m;
+            
+            // Slots the callee reaches at the unit's own level belong to the unit's frame
+            for (int s = 0; s < effectSlotCount; s++) {
+                
+                if (effectSlots[s].l >= body->level)
+                    continue;
+                
+                if (testBit(unitReads[callee], s) && ! testBit(unitReads[unit], s)) {
+                    setBit(unitReads[unit], s);
+                    changed = 1;
+                }
+                
+                if (testBit(unitWrites[callee], s) && ! testBit(unitWrites[unit], s)) {
+                    setBit(unitWrites[unit], s);
+                    changed = 1;
+                }
+            }
+            
+            if (unitAddresses[callee] > unitAddresses[unit] || unitInput[callee] > unitInput[unit]
+                || unitOutput[callee] > unitOutput[unit]) {
+                unitAddresses[unit] |= unitAddresses[callee];
+                unitInput[unit] |= unitInput[callee];
+                unitOutput[unit] |= unitOutput[callee];
+                changed = 1;
+            }
+        }
+    }
+    
+    return changed;
+}
+
+
+// Index of the slot at level and addr among effectSlots, -1 when no unit names it
+int effectSlot(int level, int addr) {
+    
+    return slotIndex(effectSlots, effectSlotCount, level, addr);
+}
+
+
+// Whether the call may read, or with writes set change, slot (l, m) of the calling unit
+// A callee that takes the address of an outer array can reach any word of that frame by index,
+// so it is taken to touch every slot it could see, as if nothing were known of it
+int callTouches(procedureUnit* unit, instruction call, int l, int m, int writes) {
+    
+    int callee = call.m;
+    
+    if (unitAddresses[callee])
+        return call.l == 0 || l > 0;
+    
+    int s = effectSlot(unit->level - l, m);
+    
+    return s >= 0 && testBit(writes ? unitWrites[callee] : unitReads[callee], s);
+}
+
+
+// Whether any call in [start, end] may change slot (l, m)
+int callsChange(procedureUnit* unit, int start, int end, int l, int m) {
+    
+    for (int i = start; i <= end; i++) {
+        if (unit->code[i].op == CAL && callTouches(unit, unit->code[i], l, m, 1))
+            return 1;
+    }
+    
+    return 0;
+}
+
+
+// Run a stage on every unit, spread over workerCount threads that each take the next unit left
+// Falls back to running the stage in place when threads are not wanted or cannot be had
+void runWorkers(void (*stage)(procedureUnit* unit)) {
+    
+    pthread_t workers[MAX_WORKERS];
+    unitQueue queue;
+    int started = 0;
+    
+    queue.stage = stage;
+    queue.next = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+    
+    for (int i = 0; i < workerCount - 1 && i < MAX_WORKERS && i < unitCount - 1; i++) {
+        if (pthread_create(&workers[started], NULL, unitWorker, &queue) == 0)
+            started++;
+    }
+    
+    // This thread works through the queue too, alone if no worker started
+    unitWorker(&queue);
+    
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    
+    pthread_mutex_destroy(&queue.lock);
+}
+
+
+// Take units off the queue and run its stage on them until none are left
+void* unitWorker(void* queue) {
+    
+    unitQueue* work = queue;
+    
+    while (1) {
+        
+        pthread_mutex_lock(&work->lock);
+        int unit = work->next++;
+        pthread_mutex_unlock(&work->lock);
+        
+        if (unit >= unitCount)
+            return NULL;
+        
+        work->stage(&units[unit]);
+    }
+}
+
+
+// Turn array loops into bulk operations, unroll the rest and turn tail calls into TCLs, cleaning up after each
+void optimizeLoops(procedureUnit* unit) {
+    
+    if (vectorizeLoops(unit))
+        optimizeUnit(unit);
+    
+    if (unrollFactor > 0 && unrollLoops(unit))
+        optimizeUnit(unit);
+    
+    if (unit != &units[0] && eliminateTailCalls(unit))
+        optimizeUnit(unit);
+}
+
+
+// Select, lay out and allocate the code of a unit that is called
+void generateUnit(procedureUnit* unit) {
+    
+    if ( ! unit->reachable)
+        return;
+    
+    selectInstructions(unit);
+    promoteScalars(unit);
+    
+    if (profiled)
+        layoutBranches(unit);
+    
+    allocateRegisters(unit);
+    fuseCounters(unit);
+}
+
+
+// Give procedures that call nothing and need no frame of their own LCL and LRT in place of CAL and RTN
+// A leaf runs in the frame of its static parent instead, so its accesses reach one level less far, and
+// a leaf that touches no variable at all is called with L 0 to spare the PMachine the chain walk
+void useLeafFrames() {
+    
+    char* leaf = leafUnit;
+    char touches[MAX_PROCEDURES];
+    char tailCalled[MAX_PROCEDURES];
+    
+    memset(tailCalled, 0, unitCount);
+    memset(touches, 0, unitCount);
+    
+    // The frame a TCL hands over must be taken and returned from in full
+    for (int i = 0; i < unitCount; i++) {
+        for (int j = 0; j < units[i].length && units[i].reachable; j++) {
+            if (units[i].code[j].op == TCL)
+                tailCalled[units[i].code[j].m] = 1;
+        }
+    }
+    
+    for (int i = 0; i < unitCount; i++) {
+        leaf[i] = isLeaf(i, tailCalled);
+    }
+    
+    for (int i = 0; i < unitCount; i++) {
+        
+        procedureUnit* unit = &units[i];
+        
+        if ( ! leaf[i])
+            continue;
+        
+        char* removed = calloc(unit->length, 1);
+        
+        removed[0] = 1;
+        
+        for (int j = 1; j < unit->length; j++) {
+            
+            instruction* in = &unit->code[j];
+            
+            if (in->op == RTN) {
+                in->op = LRT;
+            }
+            else if (in->op == LOD || in->op == STO || in->op == ADR) {
+                in->l--;
+                touches[i] = 1;
+            }
+        }
+        
+        unit->level--;
+        compactCode(unit, removed);
+        free(removed);
+    }
+    
+    for (int i = 0; i < unitCount; i++) {
+        for (int j = 0; j < units[i].length && units[i].reachable; j++) {
+            
+            instruction* in = &units[i].code[j];
+            
+            if (in->op == CAL && leaf[in->m]) {
+                in->op = LCL;
+                
+                if ( ! touches[in->m])
+                    in->l = 0;
+            }
+        }
+    }
+}
+
+
+// Whether a unit can go without a frame: a procedure with no locals, spilled registers included,
+// that calls nothing. When the layout is written the first line of a unit must run once per call, and
+// a memoized one keeps its frame as the PMachine fills its cache when that frame returns
+int isLeaf(int unit, char* tailCalled) {
+    
+    procedureUnit* body = &units[unit];
+    
+    if (unit == 0 || ! body->reachable || tailCalled[unit] || memoTable[unit] || body->code[0].op != INC
+        || body->code[0].m != 4)
+        return 0;
+    
+    for (int i = 0; i < body->length; i++) {
+        
+        int op = body->code[i].op;
+        
+        if (op == CAL || op == TCL || op == LCL || op == MCL)
+            return 0;
+        
+        if (writeLayout && isJump(op) && body->code[i].m == 1)
+            return 0;
+    }
+    
+    return 1;
+}
+
+
+// Call deterministic procedures with MCL, which the PMachine answers from a cache of earlier calls that
+// found the same values in every slot the procedure may read or write. A procedure qualifies when neither
+// it nor anything it calls does input or output, indexes an outer array or reads a local it has not
+// stored, and it loops or calls, so a lookup has more to save than it costs
+void memoizeCalls() {
+    
+    char clean[MAX_PROCEDURES];
+    int changed = 1;
+    
+    for (int u = 0; u < unitCount; u++) {
+        clean[u] = units[u].reachable && initializesLocals(&units[u]);
+    }
+    
+    // A procedure is only as clean as what it calls
+    while (changed) {
+        
+        changed = 0;
+        
+        for (int u = 0; u < unitCount; u++) {
+            for (int i = 0; i < units[u].length && clean[u]; i++) {
+                
+                instruction in = units[u].code[i];
+                
+                if ((in.op == CAL || in.op == TCL) && ! clean[in.m]) {
+                    clean[u] = 0;
+                    changed = 1;
+                }
+            }
+        }
+    }
+    
+    memoCount = 0;
+    
+    for (int u = 1; u < unitCount; u++) {
+        
+        procedureUnit* unit = &units[u];
+        int works = 0;
+        
+        if ( ! clean[u] || unitInput[u] || unitOutput[u] || unitAddresses[u])
+            continue;
+        
+        for (int i = 0; i < unit->length; i++) {
+            
+            int op = unit->code[i].op;
+            
+            if (op == CAL || op == TCL || (isJump(op) && unit->code[i].m <= i))
+                works = 1;
+        }
+        
+        if (works && memoKey(u, NULL) <= MEMO_KEY && memoKey(u, unitWrites[u]) > 0)
+            memoTable[u] = ++memoCount;
+    }
+    
+    for (int u = 0; u < unitCount; u++) {
+        for (int i = 0; i < units[u].length && units[u].reachable; i++) {
+            
+            instruction* in = &units[u].code[i];
+            
+            if (in->op == CAL && memoTable[in->m]) {
+                in->op = MCL;
+                in->r = memoTable[in->m];
+            }
+        }
+    }
+}
+
+
+// Whether the unit stores each word of its frame on every path before it reads it, or before it calls
+// a nested procedure that may read it. Whatever an earlier frame left there is no input a cache can key on
+int initializesLocals(procedureUnit* unit) {
+    
+    if (unit->code[0].op != INC)
+        return 0;
+    
+    int size = unit->code[0].m;
+    int words = bitsetWords(size);
+    int changed = 1;
+    int clean = 1;
+    
+    basicBlock* blocks = malloc((unit->length + 1) * sizeof(basicBlock));
+    int* blockOf = malloc((unit->length + 1) * sizeof(int));
+    int blockCount = findBasicBlocks(unit, blocks, blockOf);
+    int* order = malloc((blockCount + 1) * sizeof(int));
+    int orderCount = reversePostorder(blocks, blockCount, order);
+    
+    bitset* storedIn = malloc((blockCount + 1) * sizeof(bitset));
+    bitset stored = newBitset(size);
+    
+    // Nothing is stored yet on entry but the call's own words, every other block starts from all
+    for (int b = 0; b < blockCount; b++) {
+        
+        storedIn[b] = newBitset(size);
+        
+        if (b > 0)
+            memset(storedIn[b], 0xff, words * sizeof(unsigned int));
+    }
+    
+    for (int w = 0; w < 4 && w < size; w++) {
+        setBit(storedIn[0], w);
+    }
+    
+    while (changed) {
+        
+        changed = 0;
+        
+        for (int k = 0; k < orderCount; k++) {
+            
+            basicBlock* block = &blocks[order[k]];
+            
+            memcpy(stored, storedIn[order[k]], words * sizeof(unsigned int));
+            storesLocals(unit, block, stored, size);
+            
+            for (int s = 0; s < block->successorCount; s++) {
+                
+                bitset next = storedIn[block->successors[s]];
+                
+                for (int w = 0; w < words; w++) {
+                    if (next[w] & ~stored[w]) {
+                        next[w] &= stored[w];
+                        changed = 1;
+                    }
+                }
+            }
+        }
+    }
+    
+    for (int k = 0; k < orderCount && clean; k++) {
+        memcpy(stored, storedIn[order[k]], words * sizeof(unsigned int));
+        clean = storesLocals(unit, &blocks[order[k]], stored, size);
+    }
+    
+    for (int b = 0; b < blockCount; b++) {
+        free(storedIn[b]);
+    }
+    
+    free(blocks);
+    free(blockOf);
+    free(order);
+    free(storedIn);
+    free(stored);
+    
+    return clean;
+}
+
+
+// Add to stored the frame words the block stores, returns whether it reads none that were not
+int storesLocals(procedureUnit* unit, basicBlock* block, bitset stored, int size) {
+    
+    int clean = 1;
+    
+    for (int i = block->start; i < block->end; i++) {
+        
+        instruction in = unit->code[i];
+        
+        if (in.op == STO && in.l == 0 && in.m < size) {
+            setBit(stored, in.m);
+        }
+        else if ((in.op == LOD && in.l == 0) || in.op == ADDM || in.op == SUBM || in.op == MULM) {
+            clean &= in.m < size && testBit(stored, in.m);
+        }
+        else if (in.op == ADR && in.l == 0) {
+            clean = 0;
+        }
+        else if (in.op == CAL || in.op == TCL) {
+            
+            if (unitAddresses[in.m])
+                clean = 0;
+            
+            for (int s = 0; s < effectSlotCount; s++) {
+                if (effectSlots[s].l == unit->level && testBit(unitReads[in.m], s))
+                    clean &= effectSlots[s].m < size && testBit(stored, effectSlots[s].m);
+            }
+        }
+    }
+    
+    return clean;
+}
+
+
+// Slots of the key of the unit's cache, those it may read or write, or with only set just those in it
+int memoKey(int unit, bitset only) {
+    
+    int count = 0;
+    
+    for (int s = 0; s < effectSlotCount; s++) {
+        
+        int touched = testBit(unitReads[unit], s) || testBit(unitWrites[unit], s);
+        
+        if (touched && ( ! only || testBit(only, s)))
+            count++;
+    }
+    
+    return count;
+}
+
+
+// Give each procedure no chain of calls comes back to a frame at a fixed address, past the main block's
+// own words, whose frame grows to take them in. No two calls of such a procedure are ever running at once,
+// so JAL only links the frame and JRT returns from it, and every access to the frame is absolute. A frame
+// handed on by a TCL, a memoized one and a leaf, which has none, are left as they are
+void useStaticFrames() {
+    
+    char tailCalled[MAX_PROCEDURES];
+    char visited[MAX_PROCEDURES];
+    int next = MAIN_FRAME_BASE + units[0].code[0].m;
+    
+    memset(tailCalled, 0, unitCount);
+    
+    for (int i = 0; i < unitCount; i++) {
+        for (int j = 0; j < units[i].length && units[i].reachable; j++) {
+            if (units[i].code[j].op == TCL)
+                tailCalled[units[i].code[j].m] = 1;
+        }
+    }
+    
+    for (int i = 1; i < unitCount; i++) {
+        
+        procedureUnit* unit = &units[i];
+        int eligible = unit->reachable && ! tailCalled[i] && ! memoTable[i] && ! leafUnit[i]
+                       && unit->code[0].op == INC;
+        
+        for (int j = 0; j < unit->length && eligible; j++) {
+            
+            int op = unit->code[j].op;
+            
+            // Its frame is not on the stack for a TCL to hand on, and the layout counts calls by the first line
+            if (op == TCL || (writeLayout && isJump(op) && unit->code[j].m == 1))
+                eligible = 0;
+        }
+        
+        memset(visited, 0, unitCount);
+        
+        if ( ! eligible || callsUnit(i, i, visited))
+            continue;
+        
+        staticFrame[i] = next;
+        next += unit->code[0].m;
+        
+        char* removed = calloc(unit->length, 1);
+        
+        removed[0] = 1;
+        
+        for (int j = 1; j < unit->length; j++) {
+            if (unit->code[j].op == RTN)
+                unit->code[j].op = JRT;
+        }
+        
+        compactCode(unit, removed);
+        free(removed);
+    }
+    
+    units[0].code[0].m = next - MAIN_FRAME_BASE;
+    
+    for (int i = 0; i < unitCount; i++) {
+        for (int j = 0; j < units[i].length && units[i].reachable; j++) {
+            
+            instruction* in = &units[i].code[j];
+            
+            if (in->op == CAL && staticFrame[in->m]) {
+                in->op = JAL;
+                in->r = staticFrame[in->m];
+            }
+        }
+    }
+}
+
+
+// Unit whose frame an access reaches from the unit, l levels up. A leaf runs in its parent's frame
+int frameOwner(int unit, int l) {
+    
+    int owner = leafUnit[unit] ? units[unit].parent : unit;
+    
+    for (; l > 0; l--) {
+        owner = units[owner].parent;
+    }
+    
+    return owner;
+}
+
+
+// Bound the registers, stack words and activation records the program can use, so the PMachine can size
+// its memory to fit. Stack and records are left 0, unbounded, when the call graph has a cycle
+void measureProgram() {
+    
+    int need[MAX_PROCEDURES];
+    int records[MAX_PROCEDURES];
+    char state[MAX_PROCEDURES];
+    int regs[3];
+    
+    registerBound = 0;
+    
+    for (int u = 0; u < unitCount; u++) {
+        for (int i = 0; i < units[u].length && units[u].reachable; i++) {
+            
+            int def = instructionDefines(units[u].code[i]);
+            int count = instructionUses(units[u].code[i], regs);
+            
+            if (def >= registerBound)
+                registerBound = def + 1;
+            
+            for (int j = 0; j < count; j++) {
+                if (regs[j] >= registerBound)
+                    registerBound = regs[j] + 1;
+            }
+        }
+    }
+    
+    memset(state, 0, unitCount);
+    
+    // The main frame starts at 1, and the trace may look one record past the deepest
+    if (measureUnit(0, need, records, state)) {
+        stackBound = 1 + need[0];
+        recordBound = records[0] + 2;
+    }
+    else {
+        stackBound = 0;
+        recordBound = 0;
+    }
+}
+
+
+// Stack words a unit and everything it calls may take from its frame base on, and how many activation
+// records deep that goes. A CAL or MCL puts the callee on top of the frame and a TCL in place of it, a leaf
+// called with LCL has none and a JAL keeps it off the stack. Returns 0 when calls from the unit can come back to it
+int measureUnit(int unit, int* need, int* records, char* state) {
+    
+    if (state[unit])
+        return state[unit] == 2;
+    
+    state[unit] = 1;
+    
+    procedureUnit* body = &units[unit];
+    int frame = body->code[0].op == INC ? body->code[0].m : 0;
+    int own = frame > 0;
+    
+    need[unit] = frame;
+    records[unit] = own;
+    
+    for (int i = 0; i < body->length; i++) {
+        
+        instruction in = body->code[i];
+        
+        if (in.op != CAL && in.op != TCL && in.op != MCL && in.op != JAL)
+            continue;
+        
+        if ( ! measureUnit(in.m, need, records, state))
+            return 0;
+        
+        int extent = in.op != TCL ? frame + need[in.m] : need[in.m];
+        int depth = in.op != TCL ? own + records[in.m] : records[in.m];
+        
+        if (extent > need[unit])
+            need[unit] = extent;
+        if (depth > records[unit])
+            records[unit] = depth;
+    }
+    
+    state[unit] = 2;
+    
+    return 1;
+}
+
+
+// Pick the load and store opcode for each access by how far up the static chain it reaches
+// Locals need no chain walk and the parent one hop, while a frame at a fixed address needs none at all,
+// the main block's always starting at 1 and those of useStaticFrames() where it put them
+void specializeAccesses(procedureUnit* unit) {
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction* in = &unit->code[i];
+        
+        if (in->op != LOD && in->op != STO && in->op != ADR)
+            continue;
+        
+        int owner = frameOwner(unit - units, in->l);
+        int fixed = in->l == unit->level ? MAIN_FRAME_BASE : staticFrame[owner];
+        
+        // An array in a frame that never moves is at a constant address
+        if (in->op == ADR) {
+            
+            if (fixed) {
+                in->op = LIT;
+                in->l = 0;
+                in->m += fixed;
+            }
+        }
+        else if (fixed) {
+            in->op = in->op == LOD ? LDG : STG;
+            in->l = 0;
+            in->m += fixed;
+        }
+        else if (in->l == 0) {
+            in->op = in->op == LOD ? LDL : STL;
+        }
+        else if (in->l == 1) {
+            in->op = in->op == LOD ? LDP : STP;
+            in->l = 0;
+        }
+    }
+}
+
+
+// Run the program at compile time until it reads input, halts or runs out of steps, then start it
+// from where the run stopped. Writes seen so far become constants, and the main frame is restored with
+// constant stores that the optimizer then propagates into the rest of the program. The run can only
+// stop in the main block where no register is live, everything else is in the frame
+void evaluateProgram() {
+    
+    procedureUnit* main = &units[0];
+    int frameSize = main->code[0].m;
+    int sp = 0;
+    int bp = MAIN_FRAME_BASE;
+    int pc = 0;
+    int unit = 0;
+    int depth = 0;
+    int steps = 0;
+    int outputCount = 0;
+    int halted = 0;
+    int stopped = 0;
+    int abandoned = 0;
+    int resume = -1;
+    int resumeOutputs = 0;
+    int resumeSteps = 0;
+    
+    int* memory = calloc(EVALUATION_STACK, sizeof(int));
+    char* written = calloc(EVALUATION_STACK, 1);
+    int* outputs = malloc(EVALUATION_OUTPUTS * sizeof(int));
+    int* frame = calloc(frameSize, sizeof(int));
+    activation* calls = malloc(EVALUATION_STACK / 4 * sizeof(activation));
+    char* clean = calloc(main->length + 1, 1);
+    int* regs = calloc(main->registerCount + 1, sizeof(int));
+    
+    findCleanPoints(main, clean);
+    
+    while ( ! halted && ! stopped && ! abandoned) {
+        
+        instruction in = units[unit].code[pc];
+        int fields = registerFields(in.op);
+        int address;
+        int value;
+        
+        if (depth == 0 && pc > 0 && clean[pc]) {
+            resume = pc;
+            resumeOutputs = outputCount;
+            resumeSteps = steps;
+            memcpy(frame, memory + MAIN_FRAME_BASE, frameSize * sizeof(int));
+        }
+        
+        // Input is left to run time, as are writes past what the restarted program has room for
+        if (steps == evaluationBudget || in.op == SIO2 || (in.op == SIO1 && outputCount == EVALUATION_OUTPUTS)) {
+            stopped = 1;
+            continue;
+        }
+        
+        steps++;
+        pc++;
+        
+        switch (in.op) {
+                
+            case LIT:
+                regs[in.r] = in.m;
+                break;
+                
+            // Reading a local no store has set would depend on whatever an earlier frame left there
+            case LOD:
+            case STO:
+                address = evaluationBase(memory, in.l, bp) + in.m;
+                
+                if (address <= 0 || address >= EVALUATION_STACK || (in.op == LOD && ! written[address])) {
+                    abandoned = 1;
+                }
+                else if (in.op == LOD) {
+                    regs[in.r] = memory[address];
+                }
+                else {
+                    memory[address] = regs[in.r];
+                    written[address] = 1;
+                }
+                break;
+                
+            case ADR:
+                regs[in.r] = evaluationBase(memory, in.l, bp) + in.m;
+                break;
+                
+            // An index out of bounds is left for run time to fault on
+            case CHK:
+                if (regs[in.r] < 0 || regs[in.r] >= in.m)
+                    stopped = 1;
+                break;
+                
+            case LDX:
+            case STX:
+                address = regs[in.l] + regs[in.m];
+                
+                if (address <= 0 || address >= EVALUATION_STACK || (in.op == LDX && ! written[address])) {
+                    abandoned = 1;
+                }
+                else if (in.op == LDX) {
+                    regs[in.r] = memory[address];
+                }
+                else {
+                    memory[address] = regs[in.r];
+                    written[address] = 1;
+                }
+                break;
+                
+            case FIL:
+            case CPY:
+            case VAD:
+            case SUM:
+                abandoned = ! evaluateBulk(in, regs, memory, written);
+                break;
+                
+            case CAL:
+                if (sp + 4 >= EVALUATION_STACK) {
+                    abandoned = 1;
+                    break;
+                }
+                
+                memory[sp + 1] = 0;
+                memory[sp + 2] = evaluationBase(memory, in.l, bp);
+                memory[sp + 3] = bp;
+                memory[sp + 4] = 0;
+                
+                calls[depth].unit = unit;
+                calls[depth].returnAddress = pc;
+                calls[depth].regs = regs;
+                depth++;
+                
+                bp = sp + 1;
+                unit = in.m;
+                pc = 0;
+                regs = calloc(units[unit].registerCount + 1, sizeof(int));
+                break;
+                
+            // The callee takes over the frame, returning in its place
+            case TCL:
+                memory[bp] = 0;
+                memory[bp + 1] = evaluationBase(memory, in.l, bp);
+                sp = bp - 1;
+                
+                free(regs);
+                unit = in.m;
+                pc = 0;
+                regs = calloc(units[unit].registerCount + 1, sizeof(int));
+                break;
+                
+            case INC:
+                if (sp + in.m >= EVALUATION_STACK) {
+                    abandoned = 1;
+                    break;
+                }
+                
+                // The main frame starts out zeroed, a called one holds only its links
+                for (int a = sp + 1; a <= sp + in.m; a++) {
+                    written[a] = depth == 0 || a < bp + 4;
+                }
+                
+                sp += in.m;
+                break;
+                
+            case RTN:
+                if (depth == 0) {
+                    halted = 1;
+                    break;
+                }
+                
+                sp = bp - 1;
+                bp = memory[sp + 3];
+                
+                free(regs);
+                depth--;
+                unit = calls[depth].unit;
+                pc = calls[depth].returnAddress;
+                regs = calls[depth].regs;
+                break;
+                
+            case JMP:
+                pc = in.m;
+                break;
+            case JPC:
+                if (regs[in.r] == 0)
+                    pc = in.m;
+                break;
+            case JPT:
+                if (regs[in.r] != 0)
+                    pc = in.m;
+                break;
+                
+            case SIO1:
+                outputs[outputCount++] = regs[in.r];
+                break;
+            case SIO3:
+                halted = 1;
+                break;
+                
+            // A division the run would fault on is left for run time to fault on
+            default:
+                if (evaluateOperation(in.op, regs[in.l], (fields & USES_M) ? regs[in.m] : in.m, &value))
+                    regs[in.r] = value;
+                else
+                    stopped = 1;
+                break;
+        }
+    }
+    
+    if (halted)
+        restartProgram(-1, outputs, outputCount, frame, steps);
+    else if (stopped && ! abandoned && resume >= 0)
+        restartProgram(resume, outputs, resumeOutputs, frame, resumeSteps);
+    
+    while (depth > 0) {
+        free(regs);
+        regs = calls[--depth].regs;
+    }
+    
+    free(regs);
+    free(memory);
+    free(written);
+    free(outputs);
+    free(frame);
+    free(calls);
+    free(clean);
+}
+
+
+// Base of the frame l static links up from the one at bp
+int evaluationBase(int* memory, int l, int bp) {
+    
+    while (l > 0) {
+        bp = memory[bp + 1];
+        l--;
+    }
+    
+    return bp;
+}
+
+
+// Run one of the bulk opcodes over reg[m] words, with the same wrap around as the PMachine
+// Returns 0, leaving memory alone, when a word is out of range or read before anything set it
+int evaluateBulk(instruction in, int* regs, int* memory, char* written) {
+    
+    int count = regs[in.m] > 0 ? regs[in.m] : 0;
+    int to = in.op == SUM ? 1 : regs[in.r];
+    int from = in.op == FIL ? 1 : regs[in.l];
+    unsigned int sum = 0;
+    
+    if (count > 0 && (to <= 0 || from <= 0 || to + count > EVALUATION_STACK || from + count > EVALUATION_STACK))
+        return 0;
+    
+    for (int i = 0; i < count; i++) {
+        if ((in.op != FIL && ! written[from + i]) || (in.op == VAD && ! written[to + i]))
+            return 0;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        
+        switch (in.op) {
+            case FIL:
+                memory[to + i] = regs[in.l];
+                break;
+            case CPY:
+                memory[to + i] = memory[from + i];
+                break;
+            case VAD:
+                memory[to + i] = (unsigned int)memory[to + i] + (unsigned int)memory[from + i];
+                break;
+            default:
+                sum += (unsigned int)memory[from + i];
+                break;
+        }
+        
+        if (in.op != SUM)
+            written[to + i] = 1;
+    }
+    
+    if (in.op == SUM)
+        regs[in.r] = (int)sum;
+    
+    return 1;
+}
+
+
+// Mark the instructions of a unit before which no register is live
+void findCleanPoints(procedureUnit* unit, char* clean) {
+    
+    int words = bitsetWords(unit->registerCount);
+    int regs[3];
+    
+    basicBlock* blocks = malloc((unit->length + 1) * sizeof(basicBlock));
+    int* blockOf = malloc((unit->length + 1) * sizeof(int));
+    int blockCount = findBasicBlocks(unit, blocks, blockOf);
+    
+    bitset* liveOut = malloc(blockCount * sizeof(bitset));
+    
+    for (int b = 0; b < blockCount; b++) {
+        liveOut[b] = newBitset(unit->registerCount);
+    }
+    
+    computeLiveness(unit, blocks, blockCount, liveOut);
+    
+    for (int b = 0; b < blockCount; b++) {
+        
+        bitset live = liveOut[b];
+        
+        for (int i = blocks[b].end - 1; i >= blocks[b].start; i--) {
+            
+            int def = instructionDefines(unit->code[i]);
+            int count = instructionUses(unit->code[i], regs);
+            
+            if (def >= 0)
+                clearBit(live, def);
+            
+            for (int j = 0; j < count; j++) {
+                setBit(live, regs[j]);
+            }
+            
+            clean[i] = 1;
+            
+            for (int w = 0; w < words; w++) {
+                if (live[w])
+                    clean[i] = 0;
+            }
+        }
+        
+        free(liveOut[b]);
+    }
+    
+    free(liveOut);
+    free(blocks);
+    free(blockOf);
+}
+
+
+// Replace the start of the main block with the writes the compile time run made, then either halt
+// (resume < 0) or restore the frame and jump to resume. Kept only when shorter than the run it replaces
+void restartProgram(int resume, int* outputs, int outputCount, int* frame, int steps) {
+    
+    procedureUnit* main = &units[0];
+    instruction in;
+    int entry;
+    
+    procedureUnit rewritten = *main;
+    rewritten.code = NULL;
+    rewritten.length = 0;
+    rewritten.capacity = 0;
+    
+    appendCode(&rewritten, main->code[0]);
+    
+    in.site = 0;
+    in.line = 0;
+    
+    for (int i = 0; i < outputCount; i++) {
+        
+        in.op = LIT;
+        in.r = rewritten.registerCount++;
+        in.l = 0;
+        in.m = outputs[i];
+        appendCode(&rewritten, in);
+        
+        in.op = SIO1;
+        in.m = 1;
+        appendCode(&rewritten, in);
+    }
+    
+    if (resume < 0) {
+        
+        in.op = SIO3;
+        in.r = 0;
+        in.l = 0;
+        in.m = 3;
+        appendCode(&rewritten, in);
+        
+        entry = rewritten.length;
+    }
+    else {
+        
+        int* newIndex = malloc((main->length + 1) * sizeof(int));
+        
+        for (int m = 4; m < main->code[0].m; m++) {
+            
+            if (frame[m] == 0)
+                continue;
+            
+            in.op = LIT;
+            in.r = rewritten.registerCount++;
+            in.l = 0;
+            in.m = frame[m];
+            appendCode(&rewritten, in);
+            
+            in.op = STO;
+            in.m = m;
+            appendCode(&rewritten, in);
+        }
+        
+        in.op = JMP;
+        in.r = 0;
+        in.l = 0;
+        in.m = resume;
+        appendCode(&rewritten, in);
+        
+        entry = rewritten.length;
+        
+        for (int i = 1; i <= main->length; i++) {
+            
+            newIndex[i] = rewritten.length;
+            
+            if (i < main->length)
+                appendCode(&rewritten, main->code[i]);
+        }
+        
+        newIndex[0] = 0;
+        
+        relocateJumps(&rewritten, newIndex);
+        
+        free(newIndex);
+    }
+    
+    if (entry - 1 > steps) {
+        free(rewritten.code);
+        return;
+    }
+    
+    free(main->code);
+    *main = rewritten;
+    
+    optimizeUnit(main);
+}
+
+
+// Read the profile of an earlier run, with the layout of the code it ran, into unitCalls and the site
+// counters. Takes are kept in the sense of the jump as parsed. Without either file nothing is profiled
+void readProfile() {
+    
+    FILE* layout = fopen("layout.txt", "r");
+    FILE* profile = fopen("profile.txt", "r");
+    int unit, site, line;
+    int previous = -1;
+    long count, taken;
+    
+    if ( ! layout || ! profile) {
+        fprintf(stderr, "No profile found, compiling without one\n");
+        
+        if (layout)
+            fclose(layout);
+        if (profile)
+            fclose(profile);
+        
+        return;
+    }
+    
+    while (fscanf(layout, "%d %d", &unit, &site) == 2 && fscanf(profile, "%d %ld %ld", &line, &count, &taken) == 3) {
+        
+        if (unit < 0 || unit >= MAX_PROCEDURES || abs(site) >= MAX_SITES)
+            break;
+        
+        // Each unit is laid out in one piece, its first line runs once per call
+        if (unit != previous) {
+            unitProfiled[unit] = 1;
+            unitCalls[unit] += count;
+            previous = unit;
+        }
+        
+        if (site != 0) {
+            siteRuns[abs(site)] += count;
+            siteTaken[abs(site)] += site > 0 ? taken : count - taken;
+        }
+    }
+    
+    profiled = 1;
+    
+    fclose(layout);
+    fclose(profile);
+}
+
+
+// Move the colder arm of each profiled if statement out of line to the end of the unit
+// The arm left in place falls through to the code after the statement, saving the jump that used to
+// close the then part. A then part with no else that never ran is moved out as well
+// Runs after instruction selection, when the JPC may have become a compare and branch
+void layoutBranches(procedureUnit* unit) {
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction in = unit->code[i];
+        int e = in.m;
+        
+        if ((in.op != JPC && (in.op < BEQ || in.op > BGE)) || in.site <= 0 || siteRuns[in.site] == 0 || e <= i + 1)
+            continue;
+        
+        long taken = siteTaken[in.site];
+        long fallen = siteRuns[in.site] - taken;
+        instruction last = unit->code[e - 1];
+        
+        if (last.op == JMP && last.m >= e) {
+            
+            if (fallen > taken)
+                outlineRegion(unit, i, e, last.m, e - 1, last.m);
+            else if (taken > fallen)
+                outlineRegion(unit, i, i + 1, e - 1, e - 1, last.m);
+        }
+        else if (fallen == 0) {
+            outlineRegion(unit, i, i + 1, e, -1, e);
+        }
+    }
+}
+
+
+// Move [start, end) after the last instruction of the unit, followed by a jump to resume. The branch at
+// jump enters it, inverted when the region was its fall through arm. A jump at removed, closing the arm
+// that stays, goes away. Left alone when anything else jumps into the region
+void outlineRegion(procedureUnit* unit, int jump, int start, int end, int removed, int resume) {
+    
+    // Indexed from BEQ, the relation that fails where each holds
+    int inverse[6] = { BNE, BEQ, BGE, BGT, BLE, BLT };
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction in = unit->code[i];
+        
+        if ((i < start || i >= end) && i != jump && isJump(in.op) && in.m >= start && in.m < end)
+            return;
+    }
+    
+    instruction* code = malloc((unit->length + 1) * sizeof(instruction));
+    int* newIndex = malloc((unit->length + 1) * sizeof(int));
+    int length = 0;
+    
+    for (int i = 0; i < unit->length; i++) {
+        if ((i < start || i >= end) && i != removed) {
+            newIndex[i] = length;
+            code[length++] = unit->code[i];
+        }
+    }
+    
+    newIndex[unit->length] = length;
+    
+    for (int i = start; i < end; i++) {
+        newIndex[i] = length;
+        code[length++] = unit->code[i];
+    }
+    
+    code[length].op = JMP;
+    code[length].r = 0;
+    code[length].l = 0;
+    code[length].m = resume;
+    code[length].site = 0;
+    code[length].line = 0;
+    length++;
+    
+    // The closing jump only ever led to where the statement resumes
+    if (removed >= 0)
+        newIndex[removed] = newIndex[resume];
+    
+    if (start == jump + 1) {
+        int op = code[newIndex[jump]].op;
+        
+        code[newIndex[jump]].op = op == JPC ? JPT : inverse[op - BEQ];
+        code[newIndex[jump]].m = start;
+        code[newIndex[jump]].site = -code[newIndex[jump]].site;
+    }
+    
+    free(unit->code);
+    unit->code = code;
+    unit->length = length;
+    unit->capacity = length;
+    
+    relocateJumps(unit, newIndex);
+    
+    free(newIndex);
+}
+
+
+// Rewrite a unit into the immediate, memory operand and compare and branch forms
+// Runs once optimization is done, since the passes before it only know the register forms
+void selectInstructions(procedureUnit* unit) {
+    
+    fuseBranches(unit);
+    eliminateDeadCode(unit);
+    
+    useImmediates(unit);
+    eliminateDeadCode(unit);
+    
+    useMemoryOperands(unit);
+    eliminateDeadCode(unit);
+}
+
+
+// Instruction defining each register and how often each is read, -1 for registers never defined
+void countDefinitions(procedureUnit* unit, int* definition, int* uses) {
+    
+    int regs[3];
+    
+    for (int v = 0; v < unit->registerCount; v++) {
+        definition[v] = -1;
+        uses[v] = 0;
+    }
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        int def = instructionDefines(unit->code[i]);
+        int count = instructionUses(unit->code[i], regs);
+        
+        if (def >= 0)
+            definition[def] = i;
+        
+        for (int j = 0; j < count; j++) {
+            uses[regs[j]]++;
+        }
+    }
+}
+
+
+// A conditional jump on a comparison read nowhere else becomes a single compare and branch
+// JPC branches when the relation fails and JPT when it holds, the comparison is left to die
+void fuseBranches(procedureUnit* unit) {
+    
+    // Indexed from EQL: EQL, NEQ, LSS, LEQ, GTR, GEQ
+    int holds[6] = { BEQ, BNE, BLT, BLE, BGT, BGE };
+    int fails[6] = { BNE, BEQ, BGE, BGT, BLE, BLT };
+    
+    int* definition = malloc((unit->registerCount + 1) * sizeof(int));
+    int* uses = malloc((unit->registerCount + 1) * sizeof(int));
+    
+    countDefinitions(unit, definition, uses);
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction* in = &unit->code[i];
+        
+        if ((in->op != JPC && in->op != JPT) || definition[in->r] < 0 || uses[in->r] != 1)
+            continue;
+        
+        instruction compare = unit->code[definition[in->r]];
+        
+        if (compare.op < EQL || compare.op > GEQ)
+            continue;
+        
+        in->op = in->op == JPT ? holds[compare.op - EQL] : fails[compare.op - EQL];
+        in->r = compare.l;
+        in->l = compare.m;
+    }
+    
+    free(definition);
+    free(uses);
+}
+
+
+// Take constant operands of arithmetic and comparisons from M instead of a register
+// A constant on the left is moved right, mirroring the comparison where the order matters
+void useImmediates(procedureUnit* unit) {
+    
+    // Indexed from EQL, c < x is x > c and so on
+    int mirrored[6] = { EQLI, NEQI, GTRI, GEQI, LSSI, LEQI };
+    
+    int* definition = malloc((unit->registerCount + 1) * sizeof(int));
+    int* uses = malloc((unit->registerCount + 1) * sizeof(int));
+    
+    countDefinitions(unit, definition, uses);
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction* in = &unit->code[i];
+        int immediate;
+        
+        if (in->op == ADD)
+            immediate = ADDI;
+        else if (in->op == SUB)
+            immediate = SUBI;
+        else if (in->op == MUL)
+            immediate = MULI;
+        else if (in->op >= EQL && in->op <= GEQ)
+            immediate = EQLI + in->op - EQL;
+        else
+            continue;
+        
+        int leftConstant = definition[in->l] >= 0 && unit->code[definition[in->l]].op == LIT;
+        int rightConstant = definition[in->m] >= 0 && unit->code[definition[in->m]].op == LIT;
+        
+        if (rightConstant) {
+            in->op = immediate;
+            in->m = unit->code[definition[in->m]].m;
+        }
+        else if (leftConstant && in->op != SUB) {
+            
+            int value = unit->code[definition[in->l]].m;
+            
+            in->op = in->op >= EQL ? mirrored[in->op - EQL] : immediate;
+            in->l = in->m;
+            in->m = value;
+        }
+    }
+    
+    free(definition);
+    free(uses);
+}
+
+
+// Read a local operand of ADD, SUB or MUL straight from the frame when its load has no other use
+// Only within a block, and only when no store to the slot or call comes between the load and the use
+void useMemoryOperands(procedureUnit* unit) {
+    
+    int* definition = malloc((unit->registerCount + 1) * sizeof(int));
+    int* uses = malloc((unit->registerCount + 1) * sizeof(int));
+    basicBlock* blocks = malloc((unit->length + 1) * sizeof(basicBlock));
+    int* blockOf = malloc((unit->length + 1) * sizeof(int));
+    
+    countDefinitions(unit, definition, uses);
+    findBasicBlocks(unit, blocks, blockOf);
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction* in = &unit->code[i];
+        int operand;
+        
+        if (in->op != ADD && in->op != SUB && in->op != MUL)
+            continue;
+        
+        if (canReadDirectly(unit, in->m, i, definition, uses, blockOf)) {
+            operand = in->m;
+        }
+        else if (in->op != SUB && canReadDirectly(unit, in->l, i, definition, uses, blockOf)) {
+            operand = in->l;
+            in->l = in->m;
+        }
+        else {
+            continue;
+        }
+        
+        in->op = in->op == ADD ? ADDM : in->op == SUB ? SUBM : MULM;
+        in->m = unit->code[definition[operand]].m;
+        
+        // The load is now dead
+        uses[operand] = 0;
+    }
+    
+    free(definition);
+    free(uses);
+    free(blocks);
+    free(blockOf);
+}
+
+
+// Whether the register read at instruction use can instead be read from the local slot it was loaded from
+int canReadDirectly(procedureUnit* unit, int reg, int use, int* definition, int* uses, int* blockOf) {
+    
+    int load = definition[reg];
+    
+    if (load < 0 || uses[reg] != 1 || unit->code[load].op != LOD || unit->code[load].l != 0
+        || load > use || blockOf[load] != blockOf[use])
+        return 0;
+    
+    for (int k = load + 1; k < use; k++) {
+        
+        instruction in = unit->code[k];
+        
+        if ((in.op == CAL && callTouches(unit, in, 0, unit->code[load].m, 1))
+            || (in.op == STO && in.l == 0 && in.m == unit->code[load].m))
+            return 0;
+    }
+    
+    return 1;
+}
+
+
+// Keep frame variables in a register for the length of a loop, returns whether any was
+// Runs after instruction selection, as registers are written more than once from here on
+int promoteScalars(procedureUnit* unit) {
+    
+    int promoted = 0;
+    int again = 1;
+    
+    while (again) {
+        
+        again = 0;
+        
+        for (int j = 0; j < unit->length && ! again; j++) {
+            
+            instruction in = unit->code[j];
+            
+            if (isJump(in.op) && in.op != JMP && in.m <= j)
+                again = promoteLoop(unit, in.m, j);
+        }
+        
+        promoted |= again;
+    }
+    
+    return promoted;
+}
+
+
+// Promote the first eligible slot of the loop [head, tail], returns whether there was one
+// The loop must be entered only by falling into head, left only by falling out of tail and make no
+// calls, so the register is all that reads or writes the slot while it runs
+int promoteLoop(procedureUnit* unit, int head, int tail) {
+    
+    if (head == 0)
+        return 0;
+    
+    int before = unit->code[head - 1].op;
+    
+    if (before == JMP || before == RTN || before == SIO3 || before == TCL)
+        return 0;
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction in = unit->code[i];
+        int inside = i >= head && i <= tail;
+        
+        if (inside && (in.op == CAL || in.op == RTN || in.op == SIO3 || in.op == TCL))
+            return 0;
+        
+        if (isJump(in.op) && inside != (in.m >= head && in.m <= tail))
+            return 0;
+    }
+    
+    for (int i = head; i <= tail; i++) {
+        
+        instruction in = unit->code[i];
+        int eligible = in.op == LOD || in.op == STO;
+        
+        // Memory operands read the frame behind the register's back
+        for (int k = head; k <= tail && eligible; k++) {
+            
+            int op = unit->code[k].op;
+            
+            if ((op == ADDM || op == SUBM || op == MULM) && in.l == 0 && unit->code[k].m == in.m)
+                eligible = 0;
+        }
+        
+        if (eligible) {
+            promoteSlot(unit, head, tail, in.l, in.m);
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+
+// Load the slot into a new register in front of the loop and store it back where the loop falls out,
+// which jumps from outside skip. In between its loads and stores become moves, most of which
+// coalesceMoves() removes
+void promoteSlot(procedureUnit* unit, int head, int tail, int l, int m) {
+    
+    int promoted = unit->registerCount++;
+    int stored = 0;
+    int length = 0;
+    
+    instruction* code = malloc((unit->length + 3) * sizeof(instruction));
+    int* newIndex = malloc((unit->length + 1) * sizeof(int));
+    
+    for (int i = head; i <= tail; i++) {
+        if (unit->code[i].op == STO && unit->code[i].l == l && unit->code[i].m == m)
+            stored = 1;
+    }
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction in = unit->code[i];
+        
+        if (i == head) {
+            code[length].op = LOD;
+            code[length].r = promoted;
+            code[length].l = l;
+            code[length].m = m;
+            code[length].site = 0;
+            code[length].line = in.line;
+            length++;
+        }
+        
+        newIndex[i] = length;
+        
+        if (i >= head && i <= tail && (in.op == LOD || in.op == STO) && in.l == l && in.m == m) {
+            
+            int loaded = in.op == LOD;
+            int reg = in.r;
+            
+            in.op = ADDI;
+            in.r = loaded ? reg : promoted;
+            in.l = loaded ? promoted : reg;
+            in.m = 0;
+        }
+        
+        code[length++] = in;
+        
+        if (i == tail && stored) {
+            code[length].op = STO;
+            code[length].r = promoted;
+            code[length].l = l;
+            code[length].m = m;
+            code[length].site = 0;
+            code[length].line = in.line;
+            length++;
+        }
+    }
+    
+    newIndex[unit->length] = length;
+    
+    free(unit->code);
+    unit->code = code;
+    unit->length = length;
+    unit->capacity = length;
+    
+    relocateJumps(unit, newIndex);
+    
+    coalesceMoves(unit, newIndex[head], newIndex[tail], promoted);
+    
+    free(newIndex);
+}
+
+
+// Fold the moves promoteSlot() left in the loop [head, tail] into their neighbours
+// A move out of the promoted register is dropped when every read of its copy follows it in the block
+// before the promoted register changes. A move into it is dropped by having the instruction computing
+// the value write the promoted register instead, when nothing in between reads or writes it
+void coalesceMoves(procedureUnit* unit, int head, int tail, int promoted) {
+    
+    int regs[3];
+    
+    int* definition = malloc((unit->registerCount + 1) * sizeof(int));
+    int* uses = malloc((unit->registerCount + 1) * sizeof(int));
+    basicBlock* blocks = malloc((unit->length + 1) * sizeof(basicBlock));
+    int* blockOf = malloc((unit->length + 1) * sizeof(int));
+    char* removed = calloc(unit->length + 1, 1);
+    
+    countDefinitions(unit, definition, uses);
+    findBasicBlocks(unit, blocks, blockOf);
+    
+    for (int i = head; i <= tail; i++) {
+        
+        instruction in = unit->code[i];
+        
+        if (in.op != ADDI || in.m != 0 || in.l != promoted || in.r == promoted)
+            continue;
+        
+        if (renameReads(unit, i, blocks[blockOf[i]].end, in.r, promoted, uses[in.r], removed))
+            removed[i] = 1;
+    }
+    
+    for (int i = head; i <= tail; i++) {
+        
+        instruction in = unit->code[i];
+        
+        if (removed[i] || in.op != ADDI || in.m != 0 || in.r != promoted)
+            continue;
+        
+        if (in.l == promoted) {
+            removed[i] = 1;
+            continue;
+        }
+        
+        // Registers promoted for other slots are written more than once
+        int d = definition[in.l];
+        int clear = d >= head && d < i && blockOf[d] == blockOf[i];
+        
+        for (int k = 0; k < unit->length && clear; k++) {
+            if (k != d && instructionDefines(unit->code[k]) == in.l)
+                clear = 0;
+        }
+        
+        for (int k = d + 1; k < i && clear; k++) {
+            
+            if (removed[k])
+                continue;
+            
+            int count = instructionUses(unit->code[k], regs);
+            
+            for (int j = 0; j < count; j++) {
+                if (regs[j] == promoted)
+                    clear = 0;
+            }
+            
+            if (instructionDefines(unit->code[k]) == promoted)
+                clear = 0;
+        }
+        
+        if (clear && renameReads(unit, i + 1, blocks[blockOf[i]].end, in.l, promoted, uses[in.l] - 1, removed)) {
+            unit->code[d].r = promoted;
+            removed[i] = 1;
+        }
+    }
+    
+    compactCode(unit, removed);
+    
+    free(definition);
+    free(uses);
+    free(blocks);
+    free(blockOf);
+    free(removed);
+}
+
+
+// Read promoted instead of reg in [start, end) when exactly count reads of reg come there before
+// promoted is next written, returns whether it did
+int renameReads(procedureUnit* unit, int start, int end, int reg, int promoted, int count, char* removed) {
+    
+    int mask[3] = { USES_R, USES_L, USES_M };
+    int found = 0;
+    int last = start;
+    
+    for (int k = start; k < end && found < count; k++) {
+        
+        instruction in = unit->code[k];
+        int fields = registerFields(in.op);
+        int* operand[3] = { &in.r, &in.l, &in.m };
+        
+        if (removed[k])
+            continue;
+        
+        for (int f = 0; f < 3; f++) {
+            if ((fields & mask[f]) && *operand[f] == reg)
+                found++;
+        }
+        
+        last = k;
+        
+        if (instructionDefines(in) == promoted)
+            break;
+    }
+    
+    if (found != count)
+        return 0;
+    
+    for (int k = start; k <= last && count > 0; k++) {
+        
+        instruction* in = &unit->code[k];
+        int fields = registerFields(in->op);
+        int* operand[3] = { &in->r, &in->l, &in->m };
+        
+        if (removed[k])
+            continue;
+        
+        for (int f = 0; f < 3; f++) {
+            if ((fields & mask[f]) && *operand[f] == reg)
+                *operand[f] = promoted;
+        }
+    }
+    
+    return 1;
+}
+
+
+// Register operands of an opcode as a mask of USES_R, USES_L, USES_M and DEFINES_R
+int registerFields(int op) {
+    
+    switch (op) {
+            
+        case LIT:
+        case LOD:
+        case LDL:
+        case LDP:
+        case LDG:
+        case SIO2:
+        case ADR:
+            return DEFINES_R;
+        case STO:
+        case STL:
+        case STP:
+        case STG:
+        case JPC:
+        case JPT:
+        case SIO1:
+        case CHK:
+            return USES_R;
+        case BEQ:
+        case BNE:
+        case BLT:
+        case BLE:
+        case BGT:
+        case BGE:
+            return USES_R | USES_L;
+        case LOP:
+            return DEFINES_R | USES_R | USES_L;
+        case STX:
+        case FIL:
+        case CPY:
+        case VAD:
+            return USES_R | USES_L | USES_M;
+        case NEG:
+        case ODD:
+        case SHL:
+        case SHR:
+        case AND:
+        case MLH:
+        case ADDI:
+        case SUBI:
+        case MULI:
+        case EQLI:
+        case NEQI:
+        case LSSI:
+        case LEQI:
+        case GTRI:
+        case GEQI:
+        case ADDM:
+        case SUBM:
+        case MULM:
+            return DEFINES_R | USES_L;
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case MOD:
+        case EQL:
+        case NEQ:
+        case LSS:
+        case LEQ:
+        case GTR:
+        case GEQ:
+        case LDX:
+        case SUM:
+            return DEFINES_R | USES_L | USES_M;
+            
+        default:
+            return 0;
+    }
+}
+
+
+// Registers read by an instruction, returns how many were put in regs
+int instructionUses(instruction in, int* regs) {
+    
+    int fields = registerFields(in.op);
+    int count = 0;
+    
+    if (fields & USES_R)
+        regs[count++] = in.r;
+    if (fields & USES_L)
+        regs[count++] = in.l;
+    if (fields & USES_M)
+        regs[count++] = in.m;
+    
+    return count;
+}
+
+
+// Register written by an instruction, -1 if none
+int instructionDefines(instruction in) {
+    
+    if (registerFields(in.op) & DEFINES_R)
+        return in.r;
+    
+    return -1;
+}
+
+
+// Split a unit into basic blocks, returns the number of blocks
+// blockOf maps each instruction to the block holding it
+int findBasicBlocks(procedureUnit* unit, basicBlock* blocks, int* blockOf) {
+    
+    int blockCount = 0;
+    char* leader = calloc(unit->length + 1, 1);
+    
+    leader[0] = 1;
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        int op = unit->code[i].op;
+        
+        if (isJump(op)) {
+            leader[unit->code[i].m] = 1;
+        }
+        if (isJump(op) || op == RTN || op == SIO3 || op == TCL) {
+            leader[i + 1] = 1;
+        }
+    }
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        if (leader[i]) {
+            blocks[blockCount].start = i;
+            blockCount++;
+        }
+        
+        blockOf[i] = blockCount - 1;
+        blocks[blockCount - 1].end = i + 1;
+    }
+    
+    for (int b = 0; b < blockCount; b++) {
+        
+        instruction last = unit->code[blocks[b].end - 1];
+        
+        blocks[b].successorCount = 0;
+        
+        if (isJump(last.op) && last.m < unit->length) {
+            blocks[b].successors[blocks[b].successorCount++] = blockOf[last.m];
+        }
+        if (last.op != JMP && last.op != RTN && last.op != SIO3 && last.op != TCL && blocks[b].end < unit->length) {
+            blocks[b].successors[blocks[b].successorCount++] = b + 1;
+        }
+    }
+    
+    free(leader);
+    
+    return blockCount;
+}
+
+
+// Backward dataflow for the virtual registers live on exit from each block
+void computeLiveness(procedureUnit* unit, basicBlock* blocks, int blockCount, bitset* liveOut) {
+    
+    int words = bitsetWords(unit->registerCount);
+    int regs[3];
+    int changed = 1;
+    
+    bitset* liveIn = malloc(blockCount * sizeof(bitset));
+    bitset* used = malloc(blockCount * sizeof(bitset));
+    bitset* defined = malloc(blockCount * sizeof(bitset));
+    
+    for (int b = 0; b < blockCount; b++) {
+        
+        liveIn[b] = newBitset(unit->registerCount);
+        used[b] = newBitset(unit->registerCount);
+        defined[b] = newBitset(unit->registerCount);
+        
+        for (int i = blocks[b].start; i < blocks[b].end; i++) {
+            
+            int count = instructionUses(unit->code[i], regs);
+            int def = instructionDefines(unit->code[i]);
+            
+            for (int j = 0; j < count; j++) {
+                if ( ! testBit(defined[b], regs[j]))
+                    setBit(used[b], regs[j]);
+            }
+            
+            if (def >= 0)
+                setBit(defined[b], def);
+        }
+    }
+    
+    while (changed) {
+        
+        changed = 0;
+        
+        for (int b = blockCount - 1; b >= 0; b--) {
+            
+            for (int s = 0; s < blocks[b].successorCount; s++) {
+                for (int w = 0; w < words; w++) {
+                    liveOut[b][w] |= liveIn[blocks[b].successors[s]][w];
+                }
+            }
+            
+            for (int w = 0; w < words; w++) {
+                
+                unsigned int in = used[b][w] | (liveOut[b][w] & ~defined[b][w]);
+                
+                if (in != liveIn[b][w]) {
+                    liveIn[b][w] = in;
+                    changed = 1;
+                }
+            }
+        }
+    }
+    
+    for (int b = 0; b < blockCount; b++) {
+        free(liveIn[b]);
+        free(used[b]);
+        free(defined[b]);
+    }
+    
+    free(liveIn);
+    free(used);
+    free(defined);
+}
+
+
+// Map the virtual registers of a unit onto the PM/0 register file
+// Registers that do not fit are spilled to frame temporaries and allocation is retried
+void allocateRegisters(procedureUnit* unit) {
+    
+    char* unspillable = calloc(unit->registerCount + 1, 1);
+    
+    while (1) {
+        
+        int* color = malloc((unit->registerCount + 1) * sizeof(int));
+        char* spilled = calloc(unit->registerCount + 1, 1);
+        
+        if (colorRegisters(unit, color, spilled, unspillable)) {
+            
+            for (int i = 0; i < unit->length; i++) {
+                
+                instruction* in = &unit->code[i];
+                int fields = registerFields(in->op);
+                
+                if (fields & (USES_R | DEFINES_R))
+                    in->r = color[in->r];
+                if (fields & USES_L)
+                    in->l = color[in->l];
+                if (fields & USES_M)
+                    in->m = color[in->m];
+            }
+            
+            free(color);
+            free(spilled);
+            break;
+        }
+        
+        spillRegisters(unit, spilled, &unspillable);
+        
+        free(color);
+        free(spilled);
+    }
+    
+    free(unspillable);
+}
+
+
+// Color the interference graph with MAX_REGISTERS colors
+// Returns 1 on success, otherwise marks the registers to spill and returns 0
+int colorRegisters(procedureUnit* unit, int* color, char* spilled, char* unspillable) {
+    
+    int n = unit->registerCount;
+    int regs[3];
+    int success = 1;
+    
+    basicBlock* blocks = malloc((unit->length + 1) * sizeof(basicBlock));
+    int* blockOf = malloc((unit->length + 1) * sizeof(int));
+    int blockCount = findBasicBlocks(unit, blocks, blockOf);
+    
+    bitset* liveOut = malloc(blockCount * sizeof(bitset));
+    bitset live = newBitset(n);
+    
+    for (int b = 0; b < blockCount; b++) {
+        liveOut[b] = newBitset(n);
+    }
+    
+    computeLiveness(unit, blocks, blockCount, liveOut);
+    
+    // Interference graph, the triangular matrix keeps the adjacency lists free of duplicates
+    bitset matrix = newBitset((long)n * n / 2 + 1);
+    int** adjacent = calloc(n + 1, sizeof(int*));
+    int* adjacentCount = calloc(n + 1, sizeof(int));
+    int* adjacentCapacity = calloc(n + 1, sizeof(int));
+    int* uses = calloc(n + 1, sizeof(int));
+    char* crossesCall = calloc(n + 1, 1);
+    
+    for (int b = 0; b < blockCount; b++) {
+        
+        memcpy(live, liveOut[b], bitsetWords(n) * sizeof(unsigned int));
+        
+        for (int i = blocks[b].end - 1; i >= blocks[b].start; i--) {
+            
+            int def = instructionDefines(unit->code[i]);
+            int count = instructionUses(unit->code[i], regs);
+            
+            // The callee is free to use every register
+            if (unit->code[i].op == CAL) {
+                for (int v = 0; v < n; v++) {
+                    if (testBit(live, v))
+                        crossesCall[v] = 1;
+                }
+            }
+            
+            if (def >= 0) {
+                
+                for (int v = 0; v < n; v++) {
+                    
+                    if (v == def || ! testBit(live, v))
+                        continue;
+                    
+                    int high = v > def ? v : def;
+                    int low = v > def ? def : v;
+                    long edge = (long)high * (high - 1) / 2 + low;
+                    
+                    if (testBit(matrix, edge))
+                        continue;
+                    
+                    setBit(matrix, edge);
+                    
+                    for (int k = 0; k < 2; k++) {
+                        
+                        int from = k ? high : low;
+                        int to = k ? low : high;
+                        
+                        if (adjacentCount[from] == adjacentCapacity[from]) {
+                            adjacentCapacity[from] = adjacentCapacity[from] ? adjacentCapacity[from] * 2 : 8;
+                            adjacent[from] = realloc(adjacent[from], adjacentCapacity[from] * sizeof(int));
+                        }
+                        
+                        adjacent[from][adjacentCount[from]++] = to;
+                    }
+                }
+                
+                clearBit(live, def);
+                uses[def]++;
+            }
+            
+            for (int j = 0; j < count; j++) {
+                setBit(live, regs[j]);
+                uses[regs[j]]++;
+            }
+        }
+    }
+    
+    // Nothing survives a call in a register
+    for (int v = 0; v < n; v++) {
+        if (crossesCall[v]) {
+            spilled[v] = 1;
+            success = 0;
+        }
+    }
+    
+    if (success) {
+        
+        // Simplify, taking the cheapest spill candidate optimistically when every node is constrained
+        int* degree = malloc((n + 1) * sizeof(int));
+        int* stack = malloc((n + 1) * sizeof(int));
+        char* removed = calloc(n + 1, 1);
+        
+        for (int v = 0; v < n; v++) {
+            degree[v] = adjacentCount[v];
+        }
+        
+        for (int k = 0; k < n; k++) {
+            
+            int pick = -1;
+            double best = -1;
+            
+            for (int v = 0; v < n && pick < 0; v++) {
+                if ( ! removed[v] && degree[v] < MAX_REGISTERS)
+                    pick = v;
+            }
+            
+            for (int v = 0; v < n && pick < 0; v++) {
+                if ( ! removed[v] && ! unspillable[v] && (double)degree[v] / (uses[v] + 1) > best) {
+                    best = (double)degree[v] / (uses[v] + 1);
+                    pick = v;
+                }
+            }
+            
+            for (int v = 0; v < n && pick < 0; v++) {
+                if ( ! removed[v])
+                    pick = v;
+            }
+            
+            removed[pick] = 1;
+            stack[k] = pick;
+            
+            for (int j = 0; j < adjacentCount[pick]; j++) {
+                degree[adjacent[pick][j]]--;
+            }
+        }
+        
+        // Select
+        for (int v = 0; v < n; v++) {
+            color[v] = -1;
+        }
+        
+        for (int k = n - 1; k >= 0; k--) {
+            
+            int v = stack[k];
+            int taken = 0;
+            
+            for (int j = 0; j < adjacentCount[v]; j++) {
+                if (color[adjacent[v][j]] >= 0)
+                    taken |= 1 << color[adjacent[v][j]];
+            }
+            
+            for (int c = 0; c < MAX_REGISTERS && color[v] < 0; c++) {
+                if ( ! (taken & (1 << c)))
+                    color[v] = c;
+            }
+            
+            if (color[v] < 0) {
+                
+                if (unspillable[v]) {
+                    printf("\nParser register allocation failed.\n");
+                    exit(-1);
+                }
+                
+                spilled[v] = 1;
+                success = 0;
+            }
+        }
+        
+        free(degree);
+        free(stack);
+        free(removed);
+    }
+    
+    for (int b = 0; b < blockCount; b++) {
+        free(liveOut[b]);
+    }
+    
+    for (int v = 0; v < n; v++) {
+        free(adjacent[v]);
+    }
+    
+    free(liveOut);
+    free(live);
+    free(blocks);
+    free(blockOf);
+    free(matrix);
+    free(adjacent);
+    free(adjacentCount);
+    free(adjacentCapacity);
+    free(uses);
+    free(crossesCall);
+    
+    return success;
+}
+
+
+// Give every spilled register a slot past the frame, loading it into a fresh register before
+// each use and storing it after each definition. The fresh registers are never spilled again
+void spillRegisters(procedureUnit* unit, char* spilled, char** unspillable) {
+    
+    int n = unit->registerCount;
+    int* slot = malloc((n + 1) * sizeof(int));
+    int* newIndex = malloc((unit->length + 1) * sizeof(int));
+    int mask[3] = { USES_R, USES_L, USES_M };
+    
+    procedureUnit rewritten = *unit;
+    rewritten.code = NULL;
+    rewritten.length = 0;
+    rewritten.capacity = 0;
+    
+    // The INC opening the unit reserves the slots
+    for (int v = 0; v < n; v++) {
+        if (spilled[v])
+            slot[v] = unit->code[0].m++;
+    }
+    
+    for (int i = 0; i < unit->length; i++) {
+        
+        instruction in = unit->code[i];
+        instruction memory = in;
+        int* operand[3] = { &in.r, &in.l, &in.m };
+        int original[3] = { in.r, in.l, in.m };
+        int fields = registerFields(in.op);
+        
+        newIndex[i] = rewritten.length;
+        
+        for (int f = 0; f < 3; f++) {
+            
+            if ( ! (fields & mask[f]) || ! spilled[original[f]])
+                continue;
+            
+            // A register read twice by one instruction is loaded once
+            int temp = -1;
+            
+            for (int g = 0; g < f; g++) {
+                if ((fields & mask[g]) && original[g] == original[f])
+                    temp = *operand[g];
+            }
+            
+            if (temp < 0) {
+                
+                temp = rewritten.registerCount++;
+                
+                memory.op = LOD;
+                memory.r = temp;
+                memory.l = 0;
+                memory.m = slot[original[f]];
+                appendCode(&rewritten, memory);
+            }
+            
+            *operand[f] = temp;
+        }
+        
+        if ((fields & DEFINES_R) && spilled[original[0]]) {
+            
+            if ( ! (fields & USES_R))
+                in.r = rewritten.registerCount++;
+            
+            appendCode(&rewritten, in);
+            
+            memory.op = STO;
+            memory.r = in.r;
+            memory.l = 0;
+            memory.m = slot[original[0]];
+            appendCode(&rewritten, memory);
+        }
+        else {
+            appendCode(&rewritten, in);
+        }
+    }
+    
+    newIndex[unit->length] = rewritten.length;
+    
+    relocateJumps(&rewritten, newIndex);
+    
+    *unspillable = realloc(*unspillable, rewritten.registerCount + 1);
+    
+    for (int v = n; v <= rewritten.registerCount; v++) {
+        (*unspillable)[v] = 1;
+    }
+    
+    free(unit->code);
+    *unit = rewritten;
+    
+    free(slot);
+    free(newIndex);
+}
+
+
+// Fold the increment of a loop counter into the compare and branch straight after it, as a single LOP
+// Registers are allocated by now, so the counter is the same register before and after the increment
+void fuseCounters(procedureUnit* unit) {
+    
+    char* target = calloc(unit->length + 1, 1);
+    char* removed = calloc(unit->length + 1, 1);
+    int changed = 0;
+    
+    for (int i = 0; i < unit->length; i++) {
+        if (isJump(unit->code[i].op))
+            target[unit->code[i].m] = 1;
+    }
+    
+    for (int i = 0; i + 1 < unit->length; i++) {
+        
+        instruction* step = &unit->code[i];
+        instruction branch = unit->code[i + 1];
+        int counter = step->r;
+        int bound;
+        
+        if (step->op != ADDI || step->l != counter || step->m != 1 || target[i + 1])
+            continue;
+        
+        // counter <= bound, or the same with the sides swapped
+        if (branch.op == BLE && branch.r == counter && branch.l != counter)
+            bound = branch.l;
+        else if (branch.op == BGE && branch.l == counter && branch.r != counter)
+            bound = branch.r;
+        else
+            continue;
+        
+        step->op = LOP;
+        step->l = bound;
+        step->m = branch.m;
+        step->site = branch.site;
+        
+        removed[i + 1] = 1;
+        changed = 1;
+        i++;
+    }
+    
+    if (changed)
+        compactCode(unit, removed);
+    
+    free(target);
+    free(removed);
+}
+
+
+// Whether the M field of an instruction is a code address within its unit
+int isJump(int op) {
+    
+    return op == JMP || op == JPC || op == JPT || (op >= BEQ && op <= BGE) || op == LOP;
+}
+
+
+// Point the jumps of a rewritten unit at the new positions of their targets
+void relocateJumps(procedureUnit* unit, int* newIndex) {
+    
+    for (int i = 0; i < unit->length; i++) {
+        if (isJump(unit->code[i].op))
+            unit->code[i].m = newIndex[unit->code[i].m];
+    }
+}
+
+
+// Bitset helpers
+bitset newBitset(long size) {
+    
+    return calloc(size / 32 + 1, sizeof(unsigned int));
+}
+
+void setBit(bitset set, long bit) {
+    
+    set[bit / 32] |= 1u << (bit % 32);
+}
+
+void clearBit(bitset set, long bit) {
+    
+    set[bit / 32] &= ~(1u << (bit % 32));
+}
+
+int testBit(bitset set, long bit) {
+    
+    return (set[bit / 32] >> (bit % 32)) & 1;
+}
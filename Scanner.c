@@ -8,6 +8,9 @@
 //  the source program (without comments),
 //  the lexeme table,
 //  and the list of lexemes.
+//  With -p each token is also written to stdout as soon as it is scanned, one per line with the line and
+//  column it starts at, identifiers and numbers followed by their symbol table index and text, for the
+//  Parser to pull from. Errors go to stderr
 //  --
 //  
 //  
@@ -76,7 +79,11 @@ typedef enum {
     procsym = 30,
     writesym = 31,
     readsym = 32,
-    elsesym = 33
+    elsesym = 33,
+    lbracketsym = 34,
+    rbracketsym = 35,
+    forsym = 36,
+    tosym = 37
 } token_type;
 
 
@@ -87,20 +94,37 @@ node* isNumber(char firstDigit, FILE* input, node* tail, FILE* output);
 node* isSymbol(char firstSymbol, FILE* input, node* tail, FILE* output);
 void findLexeme(FILE* outputPointer, char* text, FILE* lexemelistPointer, FILE* lexemeTableFP, symbol* table, int* numberSymbol);
 int putInSymbolTable(symbol* table, char* text, int* numberSymbol);
+void emitToken(FILE* lexemelistPointer, int token);
+void emitSymbol(FILE* lexemelistPointer, int token, int index, char* text);
+void locateWord(FILE* source, long offset);
 
 
-int main() {
+// Token stream for the Parser, NULL unless -p was given
+FILE* tokenStream;
+
+// Where the word being tokenized starts in the source
+int tokenLine;
+int tokenColumn;
+
+
+int main(int argc, char* argv[]) {
     
     int currentChar;
     int buffer;
     char letter;
+    long start;
     
     int numberOfSymbols = 0;
     
-    // Create linked list
+    // Words are tokenized as soon as they are complete, so the list never holds more than one
     node *head, *tail;
     head = tail = createNode();
     
+    if (argc > 1 && strcmp(argv[1], "-p") == 0) {
+        tokenStream = stdout;
+        setvbuf(tokenStream, NULL, _IOLBF, 0);
+    }
+    
     
     
     // Symbol table
@@ -120,14 +144,23 @@ int main() {
     FILE* input = fopen(INPUT_NAME, "rb");
     
     if ( ! input) {
-        printf("\nScanner unable to open input file.\n");
+        fprintf(stderr, "\nScanner unable to open input file.\n");
         exit(1);
     }
     
-    // Create output file
+    // Second reader of the source, which counts lines up to each word
+    FILE* source = fopen(INPUT_NAME, "rb");
+    
+    // Create output files, lexeme table rows are held back until the source has been echoed
     FILE *cleanOutput = fopen("cleaninput.txt", "w+");
+    FILE* lexemeListFP = fopen("lexemelist.txt", "w+");
+    FILE* symbolTableFP = fopen("symboltable.txt", "w+");
+    FILE* lexemeTableFP = fopen("lexemetable.txt", "w+");
+    FILE* lexemeRowsFP = tmpfile();
     
     fprintf(cleanOutput, "Source Program:\n");
+    fprintf(lexemeTableFP, "\n\nLexeme Table:\n");
+    fprintf(lexemeTableFP, "lexeme\t\ttoken type\n");
     
     // Prime with the first character from input
     currentChar = fgetc(input);
@@ -136,6 +169,8 @@ int main() {
     // Processing of each word, removing comments
     while (currentChar  != EOF) {
         
+        start = ftell(input) - 1;
+        
         // if the first character is a letter, handle as a letter
         if (isalpha(currentChar)) {
             
@@ -167,28 +202,38 @@ int main() {
             fprintf(cleanOutput, "%c", currentChar);
             currentChar = fgetc(input);
         }
+        
+        // Tokenize the word just completed, if any
+        if (head != tail) {
+            
+            node* next = head->next;
+            
+            fprintf(lexemeRowsFP, "%s\t\t", head->word);
+            fprintf(lexemeTableFP, "%s\t\t", head->word);
+            locateWord(source, start);
+            findLexeme(lexemeRowsFP, head->word, lexemeListFP, lexemeTableFP, table, &numberOfSymbols);
+            
+            free(head->word);
+            free(head);
+            head = next;
+        }
     
     }
     
     fclose (input);
-    
-    // Files for outputs
-    FILE* lexemeListFP = fopen("lexemelist.txt", "w+");
-    FILE* symbolTableFP = fopen("symboltable.txt", "w+");
-    FILE* lexemeTableFP = fopen("lexemetable.txt", "w+");
+    fclose (source);
     
     
     fprintf(cleanOutput, "\n\nLexeme Table:\n");
-    fprintf(lexemeTableFP, "\n\nLexeme Table:\n");
     fprintf(cleanOutput, "lexeme\t\ttoken type\n");
-    fprintf(lexemeTableFP, "lexeme\t\ttoken type\n");
     
-    for (; head->next != NULL; head = head->next ) {
-        fprintf(cleanOutput, "%s\t\t", head->word);
-        fprintf(lexemeTableFP, "%s\t\t", head->word);
-        findLexeme(cleanOutput, head->word, lexemeListFP, lexemeTableFP, table, &numberOfSymbols);
+    rewind(lexemeRowsFP);
+    
+    while ( (currentChar = fgetc(lexemeRowsFP)) != EOF) {
+        fprintf(cleanOutput, "%c", currentChar);
     }
     
+    fclose(lexemeRowsFP);
 
     fclose(lexemeListFP);
     fclose(lexemeTableFP);
@@ -318,7 +363,7 @@ node* isNumber(char firstDigit, FILE* input, node* tail, FILE* output)
     // if the next character is a letter, print error message and exit program
     if ( isalpha(nextDigit) )
     {
-        printf("Error 22. Variable does not start with a letter. \n");
+        fprintf(stderr, "Error 22. Variable does not start with a letter. \n");
         exit(1);
     }
     
@@ -377,7 +422,7 @@ node* isSymbol(char firstSymbol, FILE* input, node* tail, FILE* output)
                         // exit program with error if no closing comments found
                         if ( nextChar == EOF )
                         {
-                            printf("Error 21. No end to comments. */ required. \n");
+                            fprintf(stderr, "Error 21. No end to comments. */ required. \n");
                             exit(1);
                         }
                         nextChar = fgetc(input);
@@ -459,7 +504,7 @@ node* isSymbol(char firstSymbol, FILE* input, node* tail, FILE* output)
             }
             else    // if not :=, then is invalid symbol
             {
-                printf("Error 20. Invalid symbol.  Exiting program.\n");
+                fprintf(stderr, "Error 20. Invalid symbol.  Exiting program.\n");
                 exit(1);
             }
             break;
@@ -472,6 +517,8 @@ node* isSymbol(char firstSymbol, FILE* input, node* tail, FILE* output)
         case '*' :
         case '(' :
         case ')' :
+        case '[' :
+        case ']' :
         case '=' :
         case ',' :
         case '.' :
@@ -479,7 +526,7 @@ node* isSymbol(char firstSymbol, FILE* input, node* tail, FILE* output)
             break;
             // if any other symbol, it is invalid.  Exit program.
         default :
-            printf("Error 20. Invalid symbol.  Exiting program.\n");
+            fprintf(stderr, "Error 20. Invalid symbol.  Exiting program.\n");
             exit(1);
             
     }// end switch case statement
@@ -511,7 +558,7 @@ void findLexeme(FILE* outputPointer, char* text, FILE* lexemelistPointer, FILE*
         // if it is too long
         if (strlen( text ) > MAX_IDENTIFIER_LENGTH )
         {
-            printf("Error 19. Variable name is too long. \n" );
+            fprintf(stderr, "Error 19. Variable name is too long. \n" );
             exit(1);
         }
         
@@ -520,72 +567,82 @@ void findLexeme(FILE* outputPointer, char* text, FILE* lexemelistPointer, FILE*
         if ( strcmp( text, "odd") == 0 ) {
             fprintf (outputPointer, "%d\n", 8 );
             fprintf (lexemeTableFP, "%d\n", 8 );
-            fprintf (lexemelistPointer, "%d ", 8 );
+            emitToken(lexemelistPointer, 8);
         }
         else if ( strcmp( text, "begin") == 0 ) {
             fprintf (outputPointer, "%d\n", 21 );
             fprintf (lexemeTableFP, "%d\n", 21 );
-            fprintf (lexemelistPointer, "%d ", 21 );
+            emitToken(lexemelistPointer, 21);
         }
         else if ( strcmp( text, "end") == 0 ) {
             fprintf (outputPointer, "%d\n", 22 );
             fprintf (lexemeTableFP, "%d\n", 22 );
-            fprintf (lexemelistPointer, "%d ", 22 );
+            emitToken(lexemelistPointer, 22);
         }
         else if ( strcmp( text, "if") == 0 ) {
             fprintf (outputPointer, "%d\n", 23 );
             fprintf (lexemeTableFP, "%d\n", 23 );
-            fprintf (lexemelistPointer, "%d ", 23 );
+            emitToken(lexemelistPointer, 23);
         }
         else if ( strcmp( text, "then") == 0 ) {
             fprintf (outputPointer, "%d\n", 24 );
             fprintf (lexemeTableFP, "%d\n", 24 );
-            fprintf (lexemelistPointer, "%d ", 24 );
+            emitToken(lexemelistPointer, 24);
         }
         else if ( strcmp( text, "while") == 0 ) {
             fprintf (outputPointer, "%d\n", 25 );
             fprintf (lexemeTableFP, "%d\n", 25 );
-            fprintf (lexemelistPointer, "%d ", 25 );
+            emitToken(lexemelistPointer, 25);
         }
         else if ( strcmp( text, "do") == 0 ) {
             fprintf (outputPointer, "%d\n", 26 );
             fprintf (lexemeTableFP, "%d\n", 26 );
-            fprintf (lexemelistPointer, "%d ", 26 );
+            emitToken(lexemelistPointer, 26);
         }
         else if ( strcmp( text, "call") == 0 ) {
             fprintf (outputPointer, "%d\n", 27 );
             fprintf (lexemeTableFP, "%d\n", 27 );
-            fprintf (lexemelistPointer, "%d ", 27 );
+            emitToken(lexemelistPointer, 27);
         }
         else if ( strcmp( text, "const") == 0 ) {
             fprintf (outputPointer, "%d\n", 28 );
             fprintf (lexemeTableFP, "%d\n", 28 );
-            fprintf (lexemelistPointer, "%d ", 28 );
+            emitToken(lexemelistPointer, 28);
         }
         else if ( strcmp( text, "var") == 0 ) {
             fprintf (outputPointer, "%d\n", 29 );
             fprintf (lexemeTableFP, "%d\n", 29 );
-            fprintf (lexemelistPointer, "%d ", 29 );
+            emitToken(lexemelistPointer, 29);
         }
         else if ( strcmp( text, "procedure") == 0 ) {
             fprintf (outputPointer, "%d\n", 30 );
             fprintf (lexemeTableFP, "%d\n", 30 );
-            fprintf (lexemelistPointer, "%d ", 30 );
+            emitToken(lexemelistPointer, 30);
         }
         else if ( strcmp( text, "write") == 0 ) {
             fprintf (outputPointer, "%d\n", 31 );
             fprintf (lexemeTableFP, "%d\n", 31 );
-            fprintf (lexemelistPointer, "%d ", 31 );
+            emitToken(lexemelistPointer, 31);
         }
         else if ( strcmp( text, "read") == 0 ) {
             fprintf (outputPointer, "%d\n", 32 );
             fprintf (lexemeTableFP, "%d\n", 32 );
-            fprintf (lexemelistPointer, "%d ", 32 );
+            emitToken(lexemelistPointer, 32);
         }
         else if ( strcmp( text, "else") == 0 ) {
             fprintf (outputPointer, "%d\n", 33 );
             fprintf (lexemeTableFP, "%d\n", 33 );
-            fprintf (lexemelistPointer, "%d ", 33 );
+            emitToken(lexemelistPointer, 33);
+        }
+        else if ( strcmp( text, "for") == 0 ) {
+            fprintf (outputPointer, "%d\n", 36 );
+            fprintf (lexemeTableFP, "%d\n", 36 );
+            emitToken(lexemelistPointer, 36);
+        }
+        else if ( strcmp( text, "to") == 0 ) {
+            fprintf (outputPointer, "%d\n", 37 );
+            fprintf (lexemeTableFP, "%d\n", 37 );
+            emitToken(lexemelistPointer, 37);
         }
         
         else    // if it is not a reserved word, it is an identifier
@@ -594,7 +651,7 @@ void findLexeme(FILE* outputPointer, char* text, FILE* lexemelistPointer, FILE*
             fprintf (outputPointer, "2\n" );
             fprintf (lexemeTableFP, "2\n" );
             index = putInSymbolTable( table, text, numberSymbol );
-            fprintf (lexemelistPointer, "2 %d ", index );
+            emitSymbol(lexemelistPointer, identsym, index, text);
         }
     }// end if first character is letter
     
@@ -604,14 +661,14 @@ void findLexeme(FILE* outputPointer, char* text, FILE* lexemelistPointer, FILE*
         // error and exit if the number has too many digits
         if (strlen( text ) > MAX_NUMBER_LENGTH )
         {
-            printf("Error 17. This number is too large. \n" );
+            fprintf(stderr, "Error 17. This number is too large. \n" );
             exit(1);
         }
         // print the appropriate token "3" and add it to the symbol table
         fprintf(outputPointer, "3\n");
         fprintf(lexemeTableFP, "3\n");
         index = putInSymbolTable( table, text, numberSymbol );
-        fprintf (lexemelistPointer, "3 %d ", index );
+        emitSymbol(lexemelistPointer, numbersym, index, text);
     }// end if first character is number
     
     // if the first character is punctuation.  Already tested for invalid
@@ -624,47 +681,57 @@ void findLexeme(FILE* outputPointer, char* text, FILE* lexemelistPointer, FILE*
             case '+' :
                 fprintf(outputPointer, "%d\n", 4);
                 fprintf(lexemeTableFP, "%d\n", 4);
-                fprintf (lexemelistPointer, "%d ", 4);
+                emitToken(lexemelistPointer, 4);
                 break;
             case '-' :
                 fprintf(outputPointer, "%d\n", 5);
                 fprintf(lexemeTableFP, "%d\n", 5);
-                fprintf (lexemelistPointer, "%d ", 5);
+                emitToken(lexemelistPointer, 5);
                 break;
             case '*' :
                 fprintf(outputPointer, "%d\n", 6);
                 fprintf(lexemeTableFP, "%d\n", 6);
-                fprintf (lexemelistPointer, "%d ", 6);
+                emitToken(lexemelistPointer, 6);
                 break;
             case '/' :
                 fprintf(outputPointer, "%d\n", 7);
                 fprintf(lexemeTableFP, "%d\n", 7);
-                fprintf (lexemelistPointer, "%d ", 7);
+                emitToken(lexemelistPointer, 7);
                 break;
             case '(' :
                 fprintf(outputPointer, "%d\n", 15);
                 fprintf(lexemeTableFP, "%d\n", 15);
-                fprintf (lexemelistPointer, "%d ", 15);
+                emitToken(lexemelistPointer, 15);
                 break;
             case ')' :
                 fprintf(outputPointer, "%d\n", 16);
                 fprintf(lexemeTableFP, "%d\n", 16);
-                fprintf (lexemelistPointer, "%d ", 16);
+                emitToken(lexemelistPointer, 16);
+                break;
+            case '[' :
+                fprintf(outputPointer, "%d\n", 34);
+                fprintf(lexemeTableFP, "%d\n", 34);
+                emitToken(lexemelistPointer, 34);
+                break;
+            case ']' :
+                fprintf(outputPointer, "%d\n", 35);
+                fprintf(lexemeTableFP, "%d\n", 35);
+                emitToken(lexemelistPointer, 35);
                 break;
             case '=' :
                 fprintf(outputPointer, "%d\n", 9);
                 fprintf(lexemeTableFP, "%d\n", 9);
-                fprintf (lexemelistPointer, "%d ", 9);
+                emitToken(lexemelistPointer, 9);
                 break;
             case ',' :
                 fprintf(outputPointer, "%d\n", 17);
                 fprintf(lexemeTableFP, "%d\n", 17);
-                fprintf (lexemelistPointer, "%d ", 17);
+                emitToken(lexemelistPointer, 17);
                 break;
             case '.' :
                 fprintf(outputPointer, "%d\n", 19);
                 fprintf(lexemeTableFP, "%d\n", 19);
-                fprintf (lexemelistPointer, "%d ", 19);
+                emitToken(lexemelistPointer, 19);
                 break;
             case '<' :     // <, <>, <=
                 // check for <> and <=
@@ -674,20 +741,20 @@ void findLexeme(FILE* outputPointer, char* text, FILE* lexemelistPointer, FILE*
                     {
                         fprintf(outputPointer, "%d\n", 10);
                         fprintf(lexemeTableFP, "%d\n", 10);
-                        fprintf (lexemelistPointer, "%d ", 10);
+                        emitToken(lexemelistPointer, 10);
                     }
                     else if ( strcmp(text, "<=") == 0 )
                     {
                         fprintf(outputPointer, "%d\n", 12);
                         fprintf(lexemeTableFP, "%d\n", 12);
-                        fprintf (lexemelistPointer, "%d ", 12);
+                        emitToken(lexemelistPointer, 12);
                     }
                 }
                 else
                 {
                     fprintf(outputPointer, "%d\n", 11);
                     fprintf(lexemeTableFP, "%d\n", 11);
-                    fprintf (lexemelistPointer, "%d ", 11);
+                    emitToken(lexemelistPointer, 11);
                 }
                 break;
             case '>' :      // > and >=
@@ -697,25 +764,25 @@ void findLexeme(FILE* outputPointer, char* text, FILE* lexemelistPointer, FILE*
                     {
                         fprintf(outputPointer, "%d\n", 14);
                         fprintf(lexemeTableFP, "%d\n", 14);
-                        fprintf (lexemelistPointer, "%d ", 14);
+                        emitToken(lexemelistPointer, 14);
                     }
                 }
                 else
                 {
                     fprintf(outputPointer, "%d\n", 13);
                     fprintf(lexemeTableFP, "%d\n", 13);
-                    fprintf (lexemelistPointer, "%d ", 13);
+                    emitToken(lexemelistPointer, 13);
                 }
                 break;
             case ';' :
                 fprintf(outputPointer, "%d\n", 18);
                 fprintf(lexemeTableFP, "%d\n", 18);
-                fprintf (lexemelistPointer, "%d ", 18);
+                emitToken(lexemelistPointer, 18);
                 break;
             case ':' :
                 fprintf(outputPointer, "%d\n", 20);
                 fprintf(lexemeTableFP, "%d\n", 20);
-                fprintf (lexemelistPointer, "%d ", 20);
+                emitToken(lexemelistPointer, 20);
                 break;
                 
         }
@@ -745,4 +812,44 @@ int putInSymbolTable(symbol* table, char* text, int* numberSymbol) {
     // return the index for the newly added string
     return ( *numberSymbol - 1 );
     
-}
\ No newline at end of file
+}
+
+// Write a token to the lexeme list, and to the token stream when there is one
+void emitToken(FILE* lexemelistPointer, int token) {
+    
+    fprintf(lexemelistPointer, "%d ", token);
+    
+    if (tokenStream)
+        fprintf(tokenStream, "%d %d %d\n", token, tokenLine, tokenColumn);
+}
+
+// Write an identifier or number token with its symbol table index, the stream also carries the text
+void emitSymbol(FILE* lexemelistPointer, int token, int index, char* text) {
+    
+    fprintf(lexemelistPointer, "%d %d ", token, index);
+    
+    if (tokenStream)
+        fprintf(tokenStream, "%d %d %d %d %s\n", token, tokenLine, tokenColumn, index, text);
+}
+
+// Set tokenLine and tokenColumn to the position of the character at offset
+// Words come in order, so the source is only ever read forward
+void locateWord(FILE* source, long offset) {
+    
+    static long position = 0;
+    static long lineStart = 0;
+    static int line = 1;
+    
+    while (position < offset) {
+        
+        if (fgetc(source) == '\n') {
+            line++;
+            lineStart = position + 1;
+        }
+        
+        position++;
+    }
+    
+    tokenLine = line;
+    tokenColumn = (int)(offset - lineStart) + 1;
+}